@@ -0,0 +1,115 @@
+require 'socket'
+
+# Sends each new image once to the whole segment as UDP broadcast
+# chunks, instead of once per Mac. Clients that miss chunks ask for just
+# those with a NAK, and the repairs are broadcast too, since neighbours
+# on the same wire usually miss the same ones.
+#
+#   chunk  'TRMB' frame_id:32 length:32 index:16 count:16, then data
+#   NAK    'TRMN' frame_id:32 count:16, then a bitmap of missing chunks,
+#          most significant bit first
+class Broadcaster
+  CHUNK_MAGIC = 'TRMB'
+  NAK_MAGIC = 'TRMN'
+  CHUNK_HEADER = 'a4 N N n n'
+  CHUNK_HEADER_SIZE = 16
+  DEFAULT_PORT = 1338
+  # Keeps every datagram inside a 576-byte IP packet, so nothing is
+  # fragmented on the way to a LocalTalk Mac
+  CHUNK_SIZE = 512
+  # Gap between chunks, so a LocalTalk bridge isn't flooded
+  CHUNK_INTERVAL = 0.02
+  # Time for the announcement to reach every subscriber before the
+  # first chunk goes out
+  ANNOUNCE_DELAY = 1.0
+  # Ignore repeat NAKs for a chunk rebroadcast this recently
+  REPAIR_HOLDOFF = 0.5
+  # Frames kept for repairs
+  HISTORY = 4
+
+  Frame = Struct.new(:id, :payload, :count, :repaired_at)
+
+  def initialize(metrics, address, port = DEFAULT_PORT, interval: CHUNK_INTERVAL)
+    @metrics = metrics
+    @address = address
+    @port = port
+    @interval = interval
+    @frames = {}
+    @lock = Mutex.new
+    @socket = UDPSocket.new
+    @socket.setsockopt(Socket::SOL_SOCKET, Socket::SO_BROADCAST, true)
+    @socket.setsockopt(Socket::SOL_SOCKET, Socket::SO_REUSEADDR, true)
+    @socket.bind('0.0.0.0', @port)
+  end
+
+  def start
+    Thread.new do
+      loop do
+        receive_nak
+      rescue => e
+        puts "Broadcast error: #{e.message}"
+      end
+    end
+  end
+
+  # Chunks needed to send payload
+  def self.chunk_count(payload)
+    (payload.bytesize + CHUNK_SIZE - 1) / CHUNK_SIZE
+  end
+
+  # Broadcast payload under id after ANNOUNCE_DELAY, and keep it around
+  # for repairs
+  def send_frame(id, payload)
+    frame = Frame.new(id, payload, self.class.chunk_count(payload), {})
+    @lock.synchronize do
+      @frames.delete(id)
+      @frames.shift if @frames.length >= HISTORY
+      @frames[id] = frame
+    end
+
+    Thread.new do
+      sleep ANNOUNCE_DELAY
+      puts "Broadcasting frame #{format('%08x', id)} (#{frame.count} chunks) to #{@address}:#{@port}"
+      frame.count.times { |index| send_chunk(frame, index) }
+    rescue => e
+      puts "Broadcast error: #{e.message}"
+    end
+  end
+
+  private
+
+  def send_chunk(frame, index)
+    data = frame.payload.byteslice(index * CHUNK_SIZE, CHUNK_SIZE)
+    header = [CHUNK_MAGIC, frame.id, frame.payload.bytesize, index, frame.count].pack(CHUNK_HEADER)
+    @socket.send(header + data, 0, @address, @port)
+    @metrics.increment('trmnl_proxy_broadcast_bytes_total', {}, CHUNK_HEADER_SIZE + data.bytesize)
+    sleep @interval
+  end
+
+  def receive_nak
+    datagram, sender = @socket.recvfrom(2048)
+    # Our own broadcasts come back to us
+    return unless datagram.start_with?(NAK_MAGIC) && datagram.bytesize >= 10
+
+    _, id, count = datagram.unpack('a4 N n')
+    frame = @lock.synchronize { @frames[id] }
+    return unless frame && frame.count == count
+
+    missing = missing_chunks(datagram.byteslice(10..), count)
+    now = Metrics.now
+    repairs = missing.reject { |index| now - frame.repaired_at.fetch(index, -Float::INFINITY) < REPAIR_HOLDOFF }
+    return if repairs.empty?
+
+    puts "Repairing #{repairs.length} of #{count} chunks of #{format('%08x', id)} for #{sender[3]}"
+    repairs.each do |index|
+      frame.repaired_at[index] = now
+      send_chunk(frame, index)
+    end
+    @metrics.increment('trmnl_proxy_broadcast_repairs_total', {}, repairs.length)
+  end
+
+  def missing_chunks(bitmap, count)
+    bits = bitmap.unpack1('B*')
+    (0...count).select { |index| bits[index] == '1' }
+  end
+end
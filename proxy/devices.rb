@@ -0,0 +1,74 @@
+require 'json'
+require_relative 'frame_store'
+
+# Maps each Mac to the TRMNL device whose screen it shows, so one proxy
+# can serve a whole fleet. Every device has its own API key, current
+# frame and fetch schedule; converted images are shared through the
+# proxy's conversion cache whenever two devices show the same picture.
+#
+# DEVICES_FILE is JSON:
+#
+#   { "devices": [
+#       { "name": "kitchen", "access_token": "...", "addresses": ["10.0.1.20"] },
+#       { "name": "office", "access_token": "...", "tokens": ["office"] }
+#   ] }
+#
+# A Mac is matched by its source address, or by a dev=<token> field in
+# its hello. ACCESS_TOKEN, if set, is the device for everyone else.
+class Devices
+  DEFAULT_NAME = 'default'
+
+  # frame is the latest image, guarded by lock
+  Device = Struct.new(:name, :access_token, :store, :frame, :lock) do
+    def to_s
+      name
+    end
+  end
+
+  # cache_dir is nil to keep frames in memory only. A lone ACCESS_TOKEN
+  # device keeps its frames in cache_dir itself, as it always has; with a
+  # DEVICES_FILE every device gets a subdirectory.
+  def initialize(path, default_token, cache_dir)
+    @by_address = {}
+    @by_token = {}
+    @devices = []
+
+    if path
+      JSON.parse(File.read(path)).fetch('devices').each do |entry|
+        device = add(entry.fetch('name'), entry.fetch('access_token'), cache_dir, true)
+        Array(entry['addresses']).each { |address| @by_address[address] = device }
+        Array(entry['tokens']).each { |token| @by_token[token] = device }
+      end
+    end
+
+    if default_token && !default_token.empty?
+      @default = add(DEFAULT_NAME, default_token, cache_dir, !path.nil?)
+    end
+  end
+
+  def empty?
+    @devices.empty?
+  end
+
+  def each(&block)
+    @devices.each(&block)
+  end
+
+  # Device for a client, or nil if it matches none and there's no default
+  def resolve(peer, hello)
+    (hello && @by_token[hello['dev']]) || @by_address[peer] || @default
+  end
+
+  private
+
+  def add(name, access_token, cache_dir, subdirectory)
+    if cache_dir
+      store = FrameStore.new(subdirectory ? File.join(cache_dir, name) : cache_dir)
+      frame = store.load
+    end
+
+    device = Device.new(name, access_token, store, frame, Mutex.new)
+    @devices << device
+    device
+  end
+end
@@ -0,0 +1,88 @@
+require 'json'
+require 'fileutils'
+
+# Keeps the latest upstream image, its metadata and every converted
+# variant on disk, so a restarted proxy can answer straight away and
+# keeps serving the last good image while usetrmnl.com is unreachable.
+#
+#   frame.json                  hash, refresh_rate, fetched_at, image_url
+#   <hash>.src                  image as fetched from upstream
+#   <hash>-<w>x<h>.<format>     converted variants, sent with sendfile
+class FrameStore
+  METADATA = 'frame.json'
+
+  # An upstream image, the SHA1 of its data and when we fetched it (wall
+  # clock seconds). digest is stored as frame.json's hash; a Struct
+  # member called hash would shadow Struct#hash.
+  Frame = Struct.new(:data, :digest, :refresh_rate, :fetched_at, :image_url) do
+    def fresh?(now = Time.now.to_i)
+      now < fetched_at + refresh_rate
+    end
+  end
+
+  def initialize(dir)
+    @dir = dir
+    @lock = Mutex.new
+    FileUtils.mkdir_p(@dir)
+  end
+
+  # Last frame saved, or nil if there isn't a usable one
+  def load
+    meta = JSON.parse(File.read(path(METADATA)))
+    data = File.binread(path("#{meta['hash']}.src"))
+    Frame.new(data, meta['hash'], meta['refresh_rate'], meta['fetched_at'], meta['image_url'])
+  rescue Errno::ENOENT, JSON::ParserError, KeyError => e
+    puts "No cached frame loaded (#{e.message})" unless e.is_a?(Errno::ENOENT)
+    nil
+  end
+
+  # Persist a newly fetched frame and drop files of older ones
+  def save(frame)
+    @lock.synchronize do
+      atomic_write("#{frame.digest}.src", frame.data) unless File.exist?(path("#{frame.digest}.src"))
+      atomic_write(METADATA, JSON.generate(
+        hash: frame.digest,
+        refresh_rate: frame.refresh_rate,
+        fetched_at: frame.fetched_at,
+        image_url: frame.image_url
+      ))
+
+      Dir.children(@dir).each do |name|
+        # Other devices' stores live in subdirectories
+        next if name == METADATA || name.start_with?(frame.digest, '.') || File.directory?(path(name))
+
+        File.delete(path(name))
+      end
+    end
+  rescue SystemCallError => e
+    puts "Error saving frame to cache: #{e.message}"
+  end
+
+  # Path of a converted variant, written from the block if it isn't on
+  # disk yet. nil if the block returns nil or the file can't be written.
+  def variant(hash, width, height, format)
+    name = "#{hash}-#{width}x#{height}.#{format}"
+    return path(name) if File.exist?(path(name))
+
+    data = yield
+    return nil unless data
+
+    @lock.synchronize { atomic_write(name, data) }
+    path(name)
+  rescue SystemCallError => e
+    puts "Error caching variant: #{e.message}"
+    nil
+  end
+
+  private
+
+  def path(name)
+    File.join(@dir, name)
+  end
+
+  def atomic_write(name, data)
+    tmp = path(".#{name}.#{Thread.current.object_id}")
+    File.binwrite(tmp, data)
+    File.rename(tmp, path(name))
+  end
+end
@@ -0,0 +1,474 @@
+require 'zlib'
+require 'digest'
+
+# Converts whatever the TRMNL image host returns (PNG or BMP, any depth)
+# into a 1-bit frame the Mac client knows how to draw: either a plain
+# bottom-up BMP, or a QDBM frame laid out exactly like a QuickDraw BitMap.
+# Pure Ruby + Zlib, no gems.
+module ImagePipeline
+  PNG_SIGNATURE = "\x89PNG\r\n\x1a\n".b
+  DITHER_MODES = %w[atkinson floyd threshold].freeze
+  # Wire formats, in the order we prefer them
+  FORMATS = %w[qdbm bmp].freeze
+  QDBM_MAGIC = 'QDBM'
+  QDBM_VERSION = 1
+  QDBM_HEADER_SIZE = 20
+
+  class UnsupportedImage < StandardError; end
+
+  # 8-bit grayscale image, one byte per pixel, top-down rows
+  Image = Struct.new(:width, :height, :pixels)
+
+  module_function
+
+  # Decode, scale to width x height (see fit_size), dither to 1-bit and
+  # encode in the given wire format. Already-suitable 1-bit BMPs are
+  # returned untouched, or just re-laid-out for QDBM.
+  def convert(data, width, height, format: 'bmp', dither: 'atkinson')
+    if passthrough_bmp?(data, width, height)
+      return format == 'qdbm' ? encode_qdbm(width, height, bmp_bits(data)) : data
+    end
+
+    image = decode(data)
+    image = scale(image, width, height) if width != image.width || height != image.height
+    bits = to_1bit(image, dither)
+    format == 'qdbm' ? encode_qdbm(width, height, bits) : encode_bmp(width, height, bits)
+  end
+
+  def decode(data)
+    if data.start_with?(PNG_SIGNATURE)
+      decode_png(data)
+    elsif data.start_with?('BM')
+      decode_bmp(data)
+    else
+      raise UnsupportedImage, 'unknown image format'
+    end
+  end
+
+  # [width, height] read straight from the PNG or BMP header
+  def dimensions(data)
+    if data.start_with?(PNG_SIGNATURE) && data.bytesize >= 24
+      data.unpack('@16 N N')
+    elsif (info = bmp_info(data))
+      [info[:width], info[:height].abs]
+    else
+      raise UnsupportedImage, 'unknown image format'
+    end
+  end
+
+  # Bytes in the frame we would emit for this size
+  def frame_size(format, width, height)
+    if format == 'qdbm'
+      QDBM_HEADER_SIZE + ((width + 15) / 16) * 2 * height
+    else
+      14 + 40 + 8 + ((width + 31) / 32) * 4 * height
+    end
+  end
+
+  # Largest size within max_width x max_height with the same aspect
+  # ratio; images are never upscaled
+  def fit_size(width, height, max_width, max_height)
+    return [width, height] if width <= max_width && height <= max_height
+
+    scale = [max_width.to_f / width, max_height.to_f / height].min
+    [[(width * scale).floor, 1].max, [(height * scale).floor, 1].max]
+  end
+
+  # Header fields of a BMP, or nil if data isn't a BMP we understand
+  def bmp_info(data)
+    return nil if data.bytesize < 54 || !data.start_with?('BM')
+
+    offset, header_size, width, height, planes, bpp, compression =
+      data.unpack('@10 V V l< l< v v V')
+    return nil if planes != 1 || header_size < 40
+
+    { offset: offset, header_size: header_size, width: width, height: height,
+      bpp: bpp, compression: compression }
+  end
+
+  # A 1-bit, bottom-up BMP with black at palette index 0 is exactly what
+  # the client's DecodeBMP expects, so it can go out as-is.
+  def passthrough_bmp?(data, width, height)
+    info = bmp_info(data)
+    return false unless info && info[:bpp] == 1 && info[:compression] == 0
+    return false unless info[:width] == width && info[:height] == height
+
+    palette = 14 + info[:header_size]
+    return false if data.bytesize < palette + 8
+
+    black = data.getbyte(palette) + data.getbyte(palette + 1) + data.getbyte(palette + 2)
+    white = data.getbyte(palette + 4) + data.getbyte(palette + 5) + data.getbyte(palette + 6)
+    black < white
+  end
+
+  def luma(r, g, b)
+    (r * 77 + g * 150 + b * 29) >> 8
+  end
+
+  # -- PNG ------------------------------------------------------------------
+
+  def decode_png(data)
+    pos = 8
+    idat = String.new(encoding: Encoding::BINARY)
+    palette = nil
+    trns = nil
+    header = nil
+
+    while pos + 8 <= data.bytesize
+      length, type = data.unpack("@#{pos} N a4")
+      body = data.byteslice(pos + 8, length)
+      pos += 12 + length
+
+      case type
+      when 'IHDR'
+        width, height, depth, color, _comp, _filter, interlace = body.unpack('N N C C C C C')
+        raise UnsupportedImage, 'interlaced PNG not supported' if interlace != 0
+        header = [width, height, depth, color]
+      when 'PLTE'
+        palette = body.unpack('C*').each_slice(3).to_a
+      when 'tRNS'
+        trns = body.unpack('C*')
+      when 'IDAT'
+        idat << body
+      when 'IEND'
+        break
+      end
+    end
+
+    raise UnsupportedImage, 'PNG has no IHDR' unless header
+
+    width, height, depth, color = header
+    channels = { 0 => 1, 2 => 3, 3 => 1, 4 => 2, 6 => 4 }[color]
+    raise UnsupportedImage, "PNG color type #{color} not supported" unless channels
+    raise UnsupportedImage, 'PNG palette missing' if color == 3 && palette.nil?
+
+    raw = png_unfilter(Zlib::Inflate.inflate(idat), width, height, depth, channels)
+    Image.new(width, height, png_to_gray(raw, width, height, depth, color, channels, palette, trns))
+  end
+
+  # Undo the per-scanline PNG filters in place; returns the bare rows
+  def png_unfilter(inflated, width, height, depth, channels)
+    stride = (width * channels * depth + 7) / 8
+    bpp = [channels * depth / 8, 1].max
+    out = String.new("\0" * (stride * height), encoding: Encoding::BINARY)
+    src = 0
+
+    height.times do |y|
+      filter = inflated.getbyte(src)
+      raise UnsupportedImage, 'truncated PNG data' if filter.nil?
+
+      src += 1
+      row = y * stride
+      prev = row - stride
+
+      case filter
+      when 0
+        out.bytesplice(row, stride, inflated.byteslice(src, stride))
+      when 1
+        stride.times do |i|
+          left = i >= bpp ? out.getbyte(row + i - bpp) : 0
+          out.setbyte(row + i, (inflated.getbyte(src + i) + left) & 0xFF)
+        end
+      when 2
+        stride.times do |i|
+          up = y > 0 ? out.getbyte(prev + i) : 0
+          out.setbyte(row + i, (inflated.getbyte(src + i) + up) & 0xFF)
+        end
+      when 3
+        stride.times do |i|
+          left = i >= bpp ? out.getbyte(row + i - bpp) : 0
+          up = y > 0 ? out.getbyte(prev + i) : 0
+          out.setbyte(row + i, (inflated.getbyte(src + i) + ((left + up) >> 1)) & 0xFF)
+        end
+      when 4
+        stride.times do |i|
+          left = i >= bpp ? out.getbyte(row + i - bpp) : 0
+          up = y > 0 ? out.getbyte(prev + i) : 0
+          upleft = i >= bpp && y > 0 ? out.getbyte(prev + i - bpp) : 0
+          p = left + up - upleft
+          pa = (p - left).abs
+          pb = (p - up).abs
+          pc = (p - upleft).abs
+          pred = pa <= pb && pa <= pc ? left : (pb <= pc ? up : upleft)
+          out.setbyte(row + i, (inflated.getbyte(src + i) + pred) & 0xFF)
+        end
+      else
+        raise UnsupportedImage, "bad PNG filter #{filter}"
+      end
+
+      src += stride
+    end
+
+    out
+  end
+
+  # Collapse unfiltered PNG rows to 8-bit gray, compositing alpha onto white
+  def png_to_gray(raw, width, height, depth, color, channels, palette, trns)
+    stride = (width * channels * depth + 7) / 8
+    gray = String.new("\0" * (width * height), encoding: Encoding::BINARY)
+    max = (1 << depth) - 1
+    step = depth == 16 ? 2 : 1
+
+    if color == 3
+      lut = palette.each_with_index.map do |(r, g, b), i|
+        alpha = trns && i < trns.length ? trns[i] : 255
+        (luma(r, g, b) * alpha + 255 * (255 - alpha)) / 255
+      end
+    end
+
+    height.times do |y|
+      row = y * stride
+      out = y * width
+
+      if depth < 8
+        per_byte = 8 / depth
+        width.times do |x|
+          byte = raw.getbyte(row + x / per_byte)
+          sample = (byte >> (8 - depth * (x % per_byte + 1))) & max
+          gray.setbyte(out + x, color == 3 ? (lut[sample] || 0) : sample * 255 / max)
+        end
+        next
+      end
+
+      width.times do |x|
+        base = row + x * channels * step
+        case color
+        when 0
+          value = raw.getbyte(base)
+        when 2
+          value = luma(raw.getbyte(base), raw.getbyte(base + step), raw.getbyte(base + 2 * step))
+        when 3
+          value = lut[raw.getbyte(base)] || 0
+        when 4
+          alpha = raw.getbyte(base + step)
+          value = (raw.getbyte(base) * alpha + 255 * (255 - alpha)) / 255
+        when 6
+          alpha = raw.getbyte(base + 3 * step)
+          value = luma(raw.getbyte(base), raw.getbyte(base + step), raw.getbyte(base + 2 * step))
+          value = (value * alpha + 255 * (255 - alpha)) / 255
+        end
+        gray.setbyte(out + x, value)
+      end
+    end
+
+    gray
+  end
+
+  # -- BMP ------------------------------------------------------------------
+
+  def decode_bmp(data)
+    info = bmp_info(data)
+    raise UnsupportedImage, 'bad BMP header' unless info
+    raise UnsupportedImage, 'compressed BMP not supported' unless [0, 3].include?(info[:compression])
+
+    width = info[:width]
+    height = info[:height].abs
+    bpp = info[:bpp]
+    bottom_up = info[:height] > 0
+    stride = ((width * bpp + 31) / 32) * 4
+    offset = info[:offset]
+    raise UnsupportedImage, 'truncated BMP' if data.bytesize < offset + stride * height
+
+    lut = nil
+    if bpp <= 8
+      colors = data.unpack1('@46 V')
+      colors = 1 << bpp if colors.zero?
+      palette = 14 + info[:header_size]
+      lut = Array.new(colors) do |i|
+        b, g, r = data.unpack("@#{palette + i * 4} C3")
+        luma(r || 0, g || 0, b || 0)
+      end
+    end
+
+    gray = String.new("\0" * (width * height), encoding: Encoding::BINARY)
+    height.times do |y|
+      row = offset + (bottom_up ? height - 1 - y : y) * stride
+      out = y * width
+
+      case bpp
+      when 1, 4, 8
+        per_byte = 8 / bpp
+        mask = (1 << bpp) - 1
+        width.times do |x|
+          byte = data.getbyte(row + x / per_byte)
+          index = (byte >> (8 - bpp * (x % per_byte + 1))) & mask
+          gray.setbyte(out + x, lut[index] || 0)
+        end
+      when 24, 32
+        size = bpp / 8
+        width.times do |x|
+          p = row + x * size
+          gray.setbyte(out + x, luma(data.getbyte(p + 2), data.getbyte(p + 1), data.getbyte(p)))
+        end
+      else
+        raise UnsupportedImage, "#{bpp}-bit BMP not supported"
+      end
+    end
+
+    Image.new(width, height, gray)
+  end
+
+  # Encode 1-bit rows (top-down, 1 = black) as a bottom-up BMP whose
+  # palette index 0 is black
+  def encode_bmp(width, height, bits)
+    src_stride = (width + 7) / 8
+    stride = ((width + 31) / 32) * 4
+    pad = "\0" * (stride - src_stride)
+    pixels = String.new(capacity: stride * height, encoding: Encoding::BINARY)
+
+    (height - 1).downto(0) do |y|
+      row = bits.byteslice(y * src_stride, src_stride)
+      # BMP bit 1 selects palette index 1 (white)
+      pixels << row.unpack('C*').map { |b| b ^ 0xFF }.pack('C*') << pad
+    end
+
+    header_size = 14 + 40 + 8
+    [
+      'BM', header_size + pixels.bytesize, 0, 0, header_size,
+      40, width, height, 1, 1, 0, pixels.bytesize, 2835, 2835, 2, 2,
+      0x00000000, 0x00FFFFFF
+    ].pack('a2 V v v V V l< l< v v V V l< l< V V V V') + pixels
+  end
+
+  # Packed top-down rows (1 = black) straight out of a passthrough BMP
+  def bmp_bits(data)
+    info = bmp_info(data)
+    width = info[:width]
+    height = info[:height]
+    stride = ((width + 31) / 32) * 4
+    row_size = (width + 7) / 8
+    bits = String.new(capacity: row_size * height, encoding: Encoding::BINARY)
+
+    (height - 1).downto(0) do |y|
+      row = data.byteslice(info[:offset] + y * stride, row_size)
+      bits << row.unpack('C*').map { |b| b ^ 0xFF }.pack('C*')
+    end
+
+    bits
+  end
+
+  # -- QDBM -----------------------------------------------------------------
+
+  # A QuickDraw BitMap on the wire: big-endian header carrying rowBytes and
+  # bounds, then top-down rows with 1 = black padded to an even rowBytes.
+  # The client points BitMap.baseAddr at the data and calls CopyBits.
+  #
+  #   'QDBM' version:16 rowBytes:16 top:16 left:16 bottom:16 right:16 length:32
+  def encode_qdbm(width, height, bits)
+    src_stride = (width + 7) / 8
+    row_bytes = ((width + 15) / 16) * 2
+    pad = "\0" * (row_bytes - src_stride)
+    pixels = String.new(capacity: row_bytes * height, encoding: Encoding::BINARY)
+
+    height.times do |y|
+      pixels << bits.byteslice(y * src_stride, src_stride) << pad
+    end
+
+    [QDBM_MAGIC, QDBM_VERSION, row_bytes, 0, 0, height, width, pixels.bytesize]
+      .pack('a4 n n n n n n N') + pixels
+  end
+
+  # -- Scaling and dithering --------------------------------------------------
+
+  # Area-average when shrinking, nearest neighbour when growing
+  def scale(image, width, height)
+    src = image.pixels
+    sw = image.width
+    sh = image.height
+    out = String.new("\0" * (width * height), encoding: Encoding::BINARY)
+
+    height.times do |y|
+      y0 = y * sh / height
+      y1 = [(y + 1) * sh / height, y0 + 1].max
+      width.times do |x|
+        x0 = x * sw / width
+        x1 = [(x + 1) * sw / width, x0 + 1].max
+        sum = 0
+        (y0...y1).each do |sy|
+          row = sy * sw
+          (x0...x1).each { |sx| sum += src.getbyte(row + sx) }
+        end
+        out.setbyte(y * width + x, sum / ((y1 - y0) * (x1 - x0)))
+      end
+    end
+
+    Image.new(width, height, out)
+  end
+
+  # Error-diffusion kernels as [dx, dy, weight] with their divisor.
+  # Atkinson only spreads 3/4 of the error, which keeps the crisp
+  # contrast the original Mac look is known for.
+  KERNELS = {
+    'atkinson' => [8, [[1, 0, 1], [2, 0, 1], [-1, 1, 1], [0, 1, 1], [1, 1, 1], [0, 2, 1]]],
+    'floyd' => [16, [[1, 0, 7], [-1, 1, 3], [0, 1, 5], [1, 1, 1]]]
+  }.freeze
+
+  # Returns packed top-down rows, MSB first, 1 = black
+  def to_1bit(image, mode = 'atkinson')
+    width = image.width
+    height = image.height
+    stride = (width + 7) / 8
+    bits = String.new("\0" * (stride * height), encoding: Encoding::BINARY)
+    divisor, taps = KERNELS[mode]
+    rows = Array.new(3) { Array.new(width, 0) } if taps
+
+    height.times do |y|
+      src = y * width
+      current = rows&.first
+
+      width.times do |x|
+        value = image.pixels.getbyte(src + x)
+        value += current[x] if current
+        black = value < 128
+        if black
+          index = y * stride + (x >> 3)
+          bits.setbyte(index, bits.getbyte(index) | (0x80 >> (x & 7)))
+        end
+        next unless taps
+
+        error = value - (black ? 0 : 255)
+        taps.each do |dx, dy, weight|
+          nx = x + dx
+          rows[dy][nx] += error * weight / divisor if nx >= 0 && nx < width
+        end
+      end
+
+      if rows
+        rows.push(rows.shift)
+        rows.last.fill(0)
+      end
+    end
+
+    bits
+  end
+
+  # Converted frames keyed by (source hash, size, format), so each upstream
+  # image is converted once no matter how many clients ask for it
+  class Cache
+    DEFAULT_CAPACITY = 16
+
+    def initialize(capacity = DEFAULT_CAPACITY)
+      @capacity = capacity
+      @entries = {}
+      @lock = Mutex.new
+    end
+
+    def fetch(source, *variant)
+      key = [Digest::SHA1.hexdigest(source), *variant]
+
+      @lock.synchronize do
+        if @entries.key?(key)
+          # Re-insert to keep the hash in least-recently-used order
+          return @entries[key] = @entries.delete(key)
+        end
+      end
+
+      converted = yield
+      @lock.synchronize do
+        @entries[key] = converted
+        @entries.delete(@entries.keys.first) while @entries.size > @capacity
+      end
+      converted
+    end
+  end
+end
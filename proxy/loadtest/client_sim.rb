@@ -0,0 +1,191 @@
+#!/usr/bin/env ruby
+
+# Simulates a room full of vintage Macs: opens N concurrent connections
+# to the proxy, sends the same hello a MacTRMNL client would, reads the
+# image at a throttled rate and reports time-to-complete percentiles.
+# With --subscribe, each client subscribes instead and waits for the
+# proxy's poller to push it that many images in all.
+
+require 'socket'
+require 'optparse'
+
+class ClientSimulator
+  # Small receive buffer so a throttled reader actually pushes back on
+  # the proxy, like a Mac with an 8 KB MacTCP buffer
+  RECEIVE_BUFFER = 8192
+  READ_SIZE = 512
+
+  Result = Struct.new(:seconds, :bytes, :error)
+
+  PUSH_HEADER = 'a4 N'
+  PUSH_IMAGE = 'IMG '
+
+  def initialize(options)
+    @host = options[:host]
+    @port = options[:port]
+    @clients = options[:clients]
+    @rounds = options[:rounds]
+    @rate = options[:rate]
+    @hello = options[:hello]
+    @timeout = options[:timeout]
+    @pushes = options[:pushes]
+    @hello = @hello.sub(/\r\n\z/, " sub=1\r\n") if @pushes && @hello && !@hello.include?(' sub=1')
+  end
+
+  def run
+    rate = @rate > 0 ? "#{@rate} B/s" : 'unthrottled'
+    puts "Simulating #{@clients} clients x #{@rounds} rounds against #{@host}:#{@port} (#{rate})"
+    puts "Each client subscribes and waits for #{@pushes} pushed images" if @pushes
+
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    results = Queue.new
+
+    threads = Array.new(@clients) do
+      Thread.new do
+        @rounds.times { results << (@pushes ? subscribe_once : fetch_once) }
+      end
+    end
+    threads.each(&:join)
+
+    elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+    report(Array.new(results.size) { results.pop }, elapsed)
+  end
+
+  private
+
+  def fetch_once
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    deadline = started + @timeout
+    bytes = 0
+
+    socket = Socket.tcp(@host, @port, connect_timeout: @timeout)
+    socket.setsockopt(Socket::SOL_SOCKET, Socket::SO_RCVBUF, RECEIVE_BUFFER)
+    socket.write(@hello) if @hello
+
+    loop do
+      remaining = deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      raise 'timed out' if remaining <= 0
+      raise 'timed out' unless socket.wait_readable(remaining)
+
+      chunk = socket.read_nonblock(READ_SIZE, exception: false)
+      break if chunk.nil?
+      next if chunk == :wait_readable
+
+      bytes += chunk.bytesize
+      throttle(started, bytes)
+    end
+
+    Result.new(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started, bytes, nil)
+  rescue => e
+    Result.new(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started, bytes, e.message)
+  ensure
+    socket&.close
+  end
+
+  # Subscribe and read push records until @pushes images have arrived,
+  # the first one included. Heartbeats and broadcast announcements are
+  # skipped.
+  def subscribe_once
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    deadline = started + @timeout
+    bytes = 0
+    images = 0
+
+    socket = Socket.tcp(@host, @port, connect_timeout: @timeout)
+    socket.setsockopt(Socket::SOL_SOCKET, Socket::SO_RCVBUF, RECEIVE_BUFFER)
+    socket.write(@hello) if @hello
+
+    while images < @pushes
+      type, length = read_exactly(socket, 8, deadline).unpack(PUSH_HEADER)
+      read_exactly(socket, length, deadline) if length > 0
+      next unless type == PUSH_IMAGE
+
+      images += 1
+      bytes += length
+    end
+
+    Result.new(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started, bytes, nil)
+  rescue => e
+    Result.new(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started, bytes,
+               "#{e.message} after #{images} of #{@pushes} images")
+  ensure
+    socket&.close
+  end
+
+  def read_exactly(socket, length, deadline)
+    data = +''
+    while data.bytesize < length
+      remaining = deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      raise 'timed out' if remaining <= 0
+      raise 'timed out' unless socket.wait_readable(remaining)
+
+      chunk = socket.read_nonblock(length - data.bytesize, exception: false)
+      raise 'connection closed' if chunk.nil?
+      next if chunk == :wait_readable
+
+      data << chunk
+    end
+    data
+  end
+
+  # Sleep until reading `bytes` would have taken that long at @rate
+  def throttle(started, bytes)
+    return if @rate <= 0
+
+    ahead = started + bytes.to_f / @rate - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    sleep(ahead) if ahead > 0
+  end
+
+  def report(results, elapsed)
+    ok = results.select { |r| r.error.nil? && r.bytes > 0 }
+    failed = results - ok
+    times = ok.map(&:seconds).sort
+    total_bytes = ok.sum(&:bytes)
+
+    puts "Requests:    #{results.length} (#{ok.length} ok, #{failed.length} failed)"
+    failed.map { |r| r.error || 'empty response' }.tally.each do |error, count|
+      puts "  #{count} x #{error}"
+    end
+    return false if times.empty?
+
+    puts format('Complete:    p50 %.2fs  p90 %.2fs  p99 %.2fs  min %.2fs  max %.2fs',
+                percentile(times, 50), percentile(times, 90), percentile(times, 99), times.first, times.last)
+    puts format('Throughput:  %.1f KB/s aggregate, %.1f KB/s per client, %.1f requests/s',
+                total_bytes / 1024.0 / elapsed,
+                ok.sum { |r| r.bytes / r.seconds } / ok.length / 1024.0,
+                ok.length / elapsed)
+    puts "Bytes:       #{total_bytes} in #{elapsed.round(2)}s"
+    failed.empty?
+  end
+
+  def percentile(sorted, pct)
+    sorted[[(sorted.length * pct / 100.0).ceil - 1, 0].max]
+  end
+end
+
+if $PROGRAM_NAME == __FILE__
+  options = {
+    host: '127.0.0.1',
+    port: 1337,
+    clients: 10,
+    rounds: 1,
+    rate: 2048,
+    timeout: 300.0,
+    hello: "TRMNL1 w=512 h=342 buf=65536 enc=qdbm,bmp\r\n"
+  }
+
+  OptionParser.new do |opts|
+    opts.banner = 'Usage: client_sim.rb [options]'
+    opts.on('-H', '--host HOST', 'Proxy host') { |v| options[:host] = v }
+    opts.on('-p', '--port PORT', Integer, 'Proxy port') { |v| options[:port] = v }
+    opts.on('-n', '--clients COUNT', Integer, 'Concurrent clients') { |v| options[:clients] = v }
+    opts.on('-r', '--rounds COUNT', Integer, 'Requests per client') { |v| options[:rounds] = v }
+    opts.on('-b', '--rate BYTES', Integer, 'Read rate per client in bytes/s (0 = unthrottled)') { |v| options[:rate] = v }
+    opts.on('-t', '--timeout SECONDS', Float, 'Give up on a request after this long') { |v| options[:timeout] = v }
+    opts.on('--hello LINE', 'Hello to send, without the trailing CRLF') { |v| options[:hello] = "#{v}\r\n" }
+    opts.on('--no-hello', 'Behave like a legacy client that sends nothing') { options[:hello] = nil }
+    opts.on('-s', '--subscribe IMAGES', Integer, 'Subscribe and wait for this many pushed images') { |v| options[:pushes] = v }
+  end.parse!
+
+  exit(ClientSimulator.new(options).run ? 0 : 1)
+end
@@ -0,0 +1,140 @@
+#!/usr/bin/env ruby
+
+# Local stand-in for usetrmnl.com: serves /api/display and the images it
+# points at, with configurable latency, error rate and redirect chains.
+# Point the proxy at it with TRMNL_API_BASE=http://127.0.0.1:<port>.
+
+require 'socket'
+require 'json'
+require 'optparse'
+
+class FakeTRMNL
+  DEFAULT_PORT = 4567
+
+  def initialize(options)
+    @port = options[:port]
+    @latency = options[:latency]
+    @jitter = options[:jitter]
+    @error_rate = options[:error_rate]
+    @redirects = options[:redirects]
+    @refresh_rate = options[:refresh_rate]
+    @images = options[:images].map { |path| File.binread(path) }
+    @rotate = options[:rotate]
+    # Rotating needs something to rotate to
+    @images << negative(@images.first) if @rotate && @images.length == 1
+    @requests = 0
+    @lock = Mutex.new
+  end
+
+  def start
+    server = TCPServer.new('127.0.0.1', @port)
+    puts "Fake TRMNL upstream on http://127.0.0.1:#{@port} " \
+         "(latency #{@latency}s, errors #{(@error_rate * 100).round}%, redirects #{@redirects})"
+
+    loop do
+      client = server.accept
+      Thread.new(client) { |c| handle(c) }
+    end
+  end
+
+  private
+
+  def handle(client)
+    request_line = client.gets
+    return unless request_line
+
+    while (line = client.gets) && line != "\r\n"
+    end
+
+    _method, path, = request_line.split(' ')
+    sleep(@latency + rand * @jitter) if @latency > 0 || @jitter > 0
+
+    if rand < @error_rate
+      status = rand < 0.5 ? '500 Internal Server Error' : '429 Too Many Requests'
+      respond(client, status, 'text/plain', "injected error\n", 'Retry-After' => '5')
+      return
+    end
+
+    case path
+    when '/api/display'
+      index = next_image_index
+      body = JSON.generate(
+        image_url: "http://127.0.0.1:#{@port}/redirect/#{@redirects}/#{index}.bmp",
+        filename: "frame-#{index}",
+        refresh_rate: @refresh_rate
+      )
+      respond(client, '200 OK', 'application/json', body)
+    when %r{\A/redirect/(\d+)/(\d+)\.bmp\z}
+      hops = Regexp.last_match(1).to_i
+      name = Regexp.last_match(2)
+      location = hops > 0 ? "/redirect/#{hops - 1}/#{name}.bmp" : "/images/#{name}.bmp"
+      respond(client, '302 Found', 'text/plain', '', 'Location' => "http://127.0.0.1:#{@port}#{location}")
+    when %r{\A/images/(\d+)\.bmp\z}
+      image = @images[Regexp.last_match(1).to_i]
+      if image
+        respond(client, '200 OK', 'image/bmp', image)
+      else
+        respond(client, '404 Not Found', 'text/plain', "no such image\n")
+      end
+    else
+      respond(client, '404 Not Found', 'text/plain', "not found\n")
+    end
+  rescue => e
+    puts "Error handling request: #{e.message}"
+  ensure
+    client.close
+  end
+
+  def next_image_index
+    @lock.synchronize do
+      @requests += 1
+      @rotate ? @requests % @images.length : 0
+    end
+  end
+
+  # The same BMP with every pixel flipped, so it hashes differently
+  def negative(image)
+    offset = image[10, 4].unpack1('V')
+    image.byteslice(0, offset) + image.byteslice(offset..).bytes.map { |b| b ^ 0xFF }.pack('C*')
+  end
+
+  def respond(client, status, type, body, headers = {})
+    head = "HTTP/1.1 #{status}\r\nContent-Type: #{type}\r\nContent-Length: #{body.bytesize}\r\n"
+    headers.each { |name, value| head << "#{name}: #{value}\r\n" }
+    client.write("#{head}Connection: close\r\n\r\n")
+    client.write(body)
+  end
+end
+
+if $PROGRAM_NAME == __FILE__
+  options = {
+    port: FakeTRMNL::DEFAULT_PORT,
+    latency: 0.0,
+    jitter: 0.0,
+    error_rate: 0.0,
+    redirects: 1,
+    refresh_rate: 300,
+    images: [],
+    rotate: false
+  }
+
+  OptionParser.new do |opts|
+    opts.banner = 'Usage: fake_trmnl.rb [options]'
+    opts.on('-p', '--port PORT', Integer, 'Port to listen on') { |v| options[:port] = v }
+    opts.on('-l', '--latency SECONDS', Float, 'Delay before every response') { |v| options[:latency] = v }
+    opts.on('-j', '--jitter SECONDS', Float, 'Extra random delay, up to this much') { |v| options[:jitter] = v }
+    opts.on('-e', '--error-rate FRACTION', Float, 'Fraction of requests answered with 500/429') { |v| options[:error_rate] = v }
+    opts.on('-r', '--redirects COUNT', Integer, 'Redirect hops before the image') { |v| options[:redirects] = v }
+    opts.on('--refresh-rate SECONDS', Integer, 'refresh_rate in /api/display') { |v| options[:refresh_rate] = v }
+    opts.on('-i', '--image PATH', 'Image to serve (repeat for several)') { |v| options[:images] << v }
+    opts.on('--rotate', 'Serve a different image on every /api/display call (one image alternates with its negative)') { options[:rotate] = true }
+  end.parse!
+
+  options[:images] << File.expand_path('../../test1.bmp', __dir__) if options[:images].empty?
+
+  begin
+    FakeTRMNL.new(options).start
+  rescue Interrupt
+    puts "\nShutting down fake upstream..."
+  end
+end
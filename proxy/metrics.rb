@@ -0,0 +1,129 @@
+require 'socket'
+
+# Counters, gauges and latency histograms for the proxy, exported in the
+# Prometheus text format. Thread-safe; timings use the monotonic clock.
+class Metrics
+  # Seconds. The top buckets are for slow Macs: 48 KB at 9600 baud takes
+  # most of a minute.
+  DEFAULT_BUCKETS = [0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120].freeze
+
+  Histogram = Struct.new(:counts, :sum, :count)
+
+  def self.now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  def initialize
+    @lock = Mutex.new
+    @help = {}
+    @types = {}
+    @counters = Hash.new { |h, name| h[name] = Hash.new(0) }
+    @histograms = Hash.new { |h, name| h[name] = {} }
+    @buckets = {}
+  end
+
+  def describe(name, type, help, buckets: DEFAULT_BUCKETS)
+    @lock.synchronize do
+      @types[name] = type
+      @help[name] = help
+      @buckets[name] = buckets if type == :histogram
+    end
+  end
+
+  def increment(name, labels = {}, by = 1)
+    @lock.synchronize { @counters[name][labels] += by }
+  end
+
+  # Gauges share the counters' storage; only their TYPE line differs
+  def set(name, value, labels = {})
+    @lock.synchronize { @counters[name][labels] = value }
+  end
+
+  def observe(name, value, labels = {})
+    @lock.synchronize do
+      buckets = @buckets[name] || DEFAULT_BUCKETS
+      histogram = @histograms[name][labels] ||= Histogram.new(Array.new(buckets.length, 0), 0.0, 0)
+      buckets.each_with_index { |le, i| histogram.counts[i] += 1 if value <= le }
+      histogram.sum += value
+      histogram.count += 1
+    end
+  end
+
+  # Time the block into a histogram, whether it returns or raises
+  def time(name, labels = {})
+    start = Metrics.now
+    yield
+  ensure
+    observe(name, Metrics.now - start, labels)
+  end
+
+  def render
+    out = String.new
+
+    @lock.synchronize do
+      @types.each_key do |name|
+        out << "# HELP #{name} #{@help[name]}\n"
+        out << "# TYPE #{name} #{@types[name]}\n"
+
+        if @types[name] == :histogram
+          buckets = @buckets[name]
+          @histograms[name].each do |labels, histogram|
+            buckets.each_with_index do |le, i|
+              out << "#{name}_bucket#{format_labels(labels.merge(le: le))} #{histogram.counts[i]}\n"
+            end
+            out << "#{name}_bucket#{format_labels(labels.merge(le: '+Inf'))} #{histogram.count}\n"
+            out << "#{name}_sum#{format_labels(labels)} #{histogram.sum.round(6)}\n"
+            out << "#{name}_count#{format_labels(labels)} #{histogram.count}\n"
+          end
+        else
+          @counters[name].each do |labels, value|
+            out << "#{name}#{format_labels(labels)} #{value}\n"
+          end
+        end
+      end
+    end
+
+    out
+  end
+
+  private
+
+  def format_labels(labels)
+    return '' if labels.empty?
+
+    '{' + labels.map { |k, v| "#{k}=\"#{v.to_s.gsub(/["\\\n]/) { |c| c == "\n" ? '\\n' : "\\#{c}" }}\"" }.join(',') + '}'
+  end
+end
+
+# Minimal HTTP listener that answers every request with the metrics text
+class MetricsServer
+  def initialize(metrics, port, bind = '127.0.0.1')
+    @metrics = metrics
+    @port = port
+    @bind = bind
+  end
+
+  def start
+    server = TCPServer.new(@bind, @port)
+    puts "Serving metrics on http://#{@bind}:#{@port}/metrics"
+
+    Thread.new do
+      loop do
+        client = server.accept
+        begin
+          # Drain the request headers; we serve the same thing for any path
+          while (line = client.gets) && line != "\r\n"
+          end
+          body = @metrics.render
+          client.write("HTTP/1.0 200 OK\r\n" \
+                       "Content-Type: text/plain; version=0.0.4\r\n" \
+                       "Content-Length: #{body.bytesize}\r\n\r\n#{body}")
+        rescue => e
+          puts "Error serving metrics: #{e.message}"
+        ensure
+          client.close
+        end
+      end
+    end
+  end
+end
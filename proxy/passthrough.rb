@@ -0,0 +1,62 @@
+require_relative 'image_pipeline'
+
+# Forwards an image to a client while it is still downloading from
+# upstream, when it needs no conversion: a 1-bit BMP already the size
+# the client asked for. Fed every chunk of the response body; until the
+# BMP header has arrived nothing is sent, and if the image turns out to
+# need converting nothing ever is, and the client is served as usual
+# once the download completes.
+class Passthrough
+  # Enough for the file and info headers (up to a BITMAPV5HEADER) and a
+  # 2-entry palette
+  PEEK_SIZE = 256
+
+  # fits is called with the start of the image and returns true if it
+  # can go to the client untouched
+  def initialize(sender, socket, peer, &fits)
+    @sender = sender
+    @socket = socket
+    @peer = peer
+    @fits = fits
+    @head = String.new(encoding: Encoding::BINARY)
+    @decided = false
+  end
+
+  # True once the client has been handed to the sender
+  def started?
+    !@connection.nil?
+  end
+
+  def <<(chunk)
+    if @connection
+      @sender.push(@connection, chunk)
+    elsif !@decided
+      @head << chunk
+      decide if @head.bytesize >= PEEK_SIZE
+    end
+    self
+  end
+
+  # The download completed
+  def finish
+    decide unless @decided
+    @sender.end_stream(@connection) if @connection
+  end
+
+  # The download failed part way; the client gets a short image and
+  # knows to throw it away
+  def abort
+    @sender.abort_stream(@connection) if @connection
+  end
+
+  private
+
+  def decide
+    @decided = true
+    return unless @fits.call(@head)
+
+    puts "Streaming BMP data to #{@peer} straight from upstream..."
+    @connection = @sender.deliver_stream(@socket, @peer)
+    @sender.push(@connection, @head)
+  end
+end
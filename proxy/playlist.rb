@@ -0,0 +1,48 @@
+require 'digest'
+require_relative 'image_pipeline'
+require_relative 'frame_store'
+
+# Serves images from a local directory in rotation instead of asking
+# TRMNL, for demos and for benchmarking the Mac without a network. Every
+# frame is validated once at load time and held in memory.
+class Playlist
+  EXTENSIONS = %w[.bmp .png].freeze
+  DEFAULT_DWELL = 60
+
+  attr_reader :frames
+
+  def initialize(dir, dwell = DEFAULT_DWELL)
+    raise ArgumentError, "PLAYLIST_DWELL must be a positive number of seconds, not #{dwell}" unless dwell.positive?
+
+    @dwell = dwell
+    @started = Time.now.to_i
+    @frames = Dir.children(dir).sort.filter_map do |name|
+      next unless EXTENSIONS.include?(File.extname(name).downcase)
+
+      load_frame(File.join(dir, name))
+    end
+
+    raise ArgumentError, "no usable images in #{dir}" if @frames.empty?
+  end
+
+  # Frame for the current dwell slot; its fetched_at/refresh_rate mark the
+  # slot, so it stays fresh until the playlist moves on
+  def current(now = Time.now.to_i)
+    slot = (now - @started) / @dwell
+    frame = @frames[slot % @frames.length].dup
+    frame.fetched_at = @started + slot * @dwell
+    frame
+  end
+
+  private
+
+  def load_frame(path)
+    data = File.binread(path).freeze
+    image = ImagePipeline.decode(data)
+    puts "Playlist: #{File.basename(path)} (#{image.width}x#{image.height})"
+    FrameStore::Frame.new(data, Digest::SHA1.hexdigest(data), @dwell, @started, "file://#{path}")
+  rescue ImagePipeline::UnsupportedImage, Zlib::Error => e
+    puts "Playlist: skipping #{File.basename(path)}: #{e.message}"
+    nil
+  end
+end
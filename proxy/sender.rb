@@ -0,0 +1,273 @@
+require 'socket'
+
+# Writes images to clients from a single IO.select loop using
+# non-blocking writes, so a Mac on a 230 kbit LocalTalk bridge (or one
+# that has hung) never holds up anyone else. Each connection costs its
+# socket, a small kernel send buffer and an offset into a payload that
+# is shared between every client receiving the same image, or into a
+# cached file that is sent with sendfile via IO.copy_stream.
+#
+# Subscribed connections stay open after their first image: new images
+# are pushed onto their queue, and a heartbeat goes out whenever they
+# have been idle for a while. A subscriber that stops answering
+# heartbeats is dropped.
+#
+# A streamed connection is sent an image as it arrives from upstream:
+# its queue may run dry before the image is complete, so it is only
+# finished (or abandoned) when the download is.
+class Sender
+  # Kept well under what a writable socket has free, so copy_stream
+  # never has to wait for room
+  CHUNK_SIZE = 4096
+  # Kernel send buffer per connection
+  SEND_BUFFER = 16384
+  # Give up on an image after this long, however fast it is going
+  WRITE_TIMEOUT = 300.0
+  # Evict clients that make no progress for this long
+  STALL_TIMEOUT = 60.0
+  # Evict clients averaging less than this many bytes/s ...
+  MIN_THROUGHPUT = 100
+  # ... once they have had this long to get going
+  THROUGHPUT_GRACE = 15.0
+  # Subscribers are sent a heartbeat after this long without traffic,
+  # and dropped if we hear nothing back for three of them
+  HEARTBEAT_INTERVAL = 30.0
+  MISSED_HEARTBEATS = 3
+
+  # One part of an outgoing message: a String, or a File sent with sendfile
+  Part = Struct.new(:data, :file, :size)
+
+  # A client connection. queue holds the parts still to send; offset is
+  # how far into the first one we are. image is false while only a
+  # heartbeat is going out. streaming is true while more of the image is
+  # still to come.
+  Connection = Struct.new(:socket, :peer, :queue, :offset, :sent, :image, :subscribed, :heartbeat,
+                          :on_close, :started, :progress_at, :active_at, :heard_at, :streaming)
+
+  def initialize(metrics, write_timeout: WRITE_TIMEOUT, stall_timeout: STALL_TIMEOUT,
+                 min_throughput: MIN_THROUGHPUT, grace: THROUGHPUT_GRACE,
+                 heartbeat_interval: HEARTBEAT_INTERVAL)
+    @metrics = metrics
+    @write_timeout = write_timeout
+    @stall_timeout = stall_timeout
+    @min_throughput = min_throughput
+    @grace = grace
+    @heartbeat_interval = heartbeat_interval
+    @commands = Queue.new
+    @connections = {}
+    @wake_reader, @wake_writer = IO.pipe
+  end
+
+  def start
+    Thread.new do
+      loop do
+        run_once
+      rescue => e
+        puts "Sender error: #{e.message}"
+        puts e.backtrace.join("\n")
+      end
+    end
+  end
+
+  # Hand a connected client its image. Safe to call from any thread; the
+  # sender owns (and eventually closes) the socket from here on.
+  def deliver(socket, payload, peer)
+    add(socket, peer, [string_part(payload)])
+  end
+
+  # Like deliver, but streams the image from a file on disk
+  def deliver_file(socket, path, peer)
+    file = File.open(path, 'rb')
+    add(socket, peer, [Part.new(nil, file, file.size)])
+  end
+
+  # Like deliver, but the image is pushed a chunk at a time as it
+  # downloads, then ended with end_stream or abort_stream. Returns the
+  # connection to push to.
+  def deliver_stream(socket, peer)
+    add(socket, peer, [], streaming: true)
+  end
+
+  def end_stream(connection)
+    command(:end_stream, connection, [], true)
+  end
+
+  # Drop a streamed client whose image can't be finished
+  def abort_stream(connection)
+    command(:abort_stream, connection, [], true)
+  end
+
+  # Keep the connection open after sending parts, sending heartbeat when
+  # idle. on_close is called (on the sender thread) once it goes away.
+  # Returns the connection to push to.
+  def subscribe(socket, peer, parts, heartbeat, &on_close)
+    add(socket, peer, parts.map { |part| string_part(part) }, heartbeat, on_close)
+  end
+
+  # Queue more parts on a subscribed connection. Safe from any thread.
+  # image: false for control records that shouldn't count as an image served.
+  def push(connection, *parts, image: true)
+    command(:push, connection, parts.map { |part| string_part(part) }, image)
+  end
+
+  private
+
+  def string_part(data)
+    data = data.dup.freeze unless data.frozen?
+    Part.new(data, nil, data.bytesize)
+  end
+
+  def add(socket, peer, parts, heartbeat = nil, on_close = nil, streaming: false)
+    socket.setsockopt(Socket::SOL_SOCKET, Socket::SO_SNDBUF, SEND_BUFFER)
+    now = Metrics.now
+    connection = Connection.new(socket, peer, [], 0, 0, true, !heartbeat.nil?, heartbeat, on_close,
+                                now, now, now, now, streaming)
+    command(:add, connection, parts, true)
+    connection
+  end
+
+  def command(*args)
+    @commands << args
+    @wake_writer.write_nonblock('.', exception: false)
+  end
+
+  def run_once
+    until @commands.empty?
+      action, connection, parts, image = @commands.pop
+      next if action != :add && !@connections.key?(connection.socket)
+
+      case action
+      when :end_stream
+        connection.streaming = false
+        complete(connection) if connection.queue.empty?
+      when :abort_stream
+        close(connection, 'image_stream', 'upstream failed part way through the image')
+      else
+        start_message(connection) if action == :add || (connection.queue.empty? && !connection.streaming)
+        connection.image ||= image
+        connection.queue.concat(parts)
+        @connections[connection.socket] = connection
+      end
+    end
+
+    sending = @connections.values.reject { |c| c.queue.empty? }.map(&:socket)
+    listening = @connections.values.select(&:subscribed).map(&:socket)
+    readable, writable, = IO.select([@wake_reader] + listening, sending, nil, 1.0)
+    @wake_reader.read_nonblock(1024, exception: false)
+
+    readable&.each { |socket| read_from(@connections[socket]) if @connections.key?(socket) }
+    writable&.each { |socket| write_chunk(@connections[socket]) if @connections.key?(socket) }
+    check_connections
+  end
+
+  # Deadlines and throughput are measured per message, so a subscriber's
+  # idle time between pushes doesn't count against it
+  def start_message(connection)
+    now = Metrics.now
+    connection.started = now
+    connection.progress_at = now
+    connection.sent = 0
+    connection.image = false
+  end
+
+  def read_from(connection)
+    data = connection.socket.read_nonblock(256, exception: false)
+    return if data == :wait_readable
+
+    if data.nil?
+      close(connection, nil, 'unsubscribed')
+    else
+      connection.heard_at = Metrics.now
+    end
+  rescue IOError, SystemCallError => e
+    close(connection, 'client_read', e.message)
+  end
+
+  def write_chunk(connection)
+    part = connection.queue.first
+    if part.file
+      length = [CHUNK_SIZE, part.size - connection.offset].min
+      written = IO.copy_stream(part.file, connection.socket, length, connection.offset)
+    else
+      chunk = part.data.byteslice(connection.offset, CHUNK_SIZE)
+      written = connection.socket.write_nonblock(chunk, exception: false)
+      return if written == :wait_writable
+    end
+
+    now = Metrics.now
+    connection.offset += written
+    connection.sent += written
+    connection.progress_at = now
+    connection.active_at = now
+    return if connection.offset < part.size
+
+    part.file&.close
+    connection.queue.shift
+    connection.offset = 0
+    # A streamed image may just be waiting on upstream
+    complete(connection) if connection.queue.empty? && !connection.streaming
+  rescue IOError, SystemCallError => e
+    close(connection, 'client_write', e.message)
+  end
+
+  def complete(connection)
+    finish_message(connection)
+    close(connection) unless connection.subscribed
+  end
+
+  def finish_message(connection)
+    @metrics.observe('trmnl_proxy_stage_duration_seconds', Metrics.now - connection.started, stage: 'write')
+    @metrics.increment('trmnl_proxy_bytes_sent_total', {}, connection.sent)
+    return unless connection.image
+
+    puts "Image sent to #{connection.peer} (#{connection.sent} bytes)"
+    @metrics.increment('trmnl_proxy_clients_served_total')
+  end
+
+  def check_connections
+    now = Metrics.now
+
+    @connections.values.each do |connection|
+      if connection.queue.empty?
+        check_subscriber(connection, now) if connection.subscribed
+        next
+      end
+
+      elapsed = now - connection.started
+      if elapsed > @write_timeout
+        close(connection, 'client_timeout', "no complete image after #{elapsed.round}s")
+      elsif now - connection.progress_at > @stall_timeout
+        close(connection, 'client_stalled', "no progress for #{(now - connection.progress_at).round}s")
+      elsif elapsed > @grace && connection.sent / elapsed < @min_throughput
+        close(connection, 'client_slow', "only #{(connection.sent / elapsed).round} bytes/s")
+      end
+    end
+  end
+
+  def check_subscriber(connection, now)
+    if now - connection.heard_at > @heartbeat_interval * MISSED_HEARTBEATS
+      close(connection, 'subscriber_timeout', "no heartbeat for #{(now - connection.heard_at).round}s")
+    elsif now - connection.active_at > @heartbeat_interval
+      start_message(connection)
+      connection.queue << string_part(connection.heartbeat)
+    end
+  end
+
+  def close(connection, error = nil, reason = nil)
+    @connections.delete(connection.socket)
+    connection.socket.close unless connection.socket.closed?
+    connection.queue.each { |part| part.file&.close }
+
+    if error
+      unless connection.queue.empty?
+        @metrics.increment('trmnl_proxy_bytes_sent_total', {}, connection.sent)
+      end
+      puts "Dropped #{connection.peer} after #{connection.sent} bytes: #{reason}"
+      @metrics.increment('trmnl_proxy_errors_total', type: error)
+    elsif reason
+      puts "#{connection.peer} disconnected: #{reason}"
+    end
+
+    connection.on_close&.call(connection)
+  end
+end
@@ -0,0 +1,46 @@
+require 'digest'
+require 'zlib'
+
+# Resumable transfer framing for clients on flaky serial and PPP links.
+# The image follows a 20-byte header in chunks, each followed by its
+# CRC-32, so the client keeps every chunk it has verified. If the link
+# drops, it reconnects with resume=<frame_id>:<offset> and the proxy
+# sends the rest.
+#
+#   header  'XFER' frame_id:32 length:32 offset:32 chunk_size:16 reserved:16
+#   chunk   min(chunk_size, length - position) bytes, then crc32:32
+module Transfer
+  MAGIC = 'XFER'
+  # About a second of 9600 baud
+  CHUNK_SIZE = 1024
+
+  module_function
+
+  # Identifies a converted image, so a client resuming it can tell it
+  # is still the same one
+  def frame_id(payload)
+    Digest::SHA1.hexdigest(payload)[0, 8].to_i(16)
+  end
+
+  # Parse a resume=<frame_id hex>:<offset> hello field
+  def parse_resume(value)
+    id, offset = value.to_s.split(':', 2)
+    return nil unless id&.match?(/\A\h{1,8}\z/) && offset&.match?(/\A\d+\z/)
+
+    [id.to_i(16), offset.to_i]
+  end
+
+  # Framed payload starting at offset, rounded down to a chunk boundary;
+  # from the start if offset doesn't fit this payload
+  def framed(payload, offset = 0)
+    offset = 0 unless offset.between?(0, payload.bytesize)
+    offset -= offset % CHUNK_SIZE
+
+    out = [MAGIC, frame_id(payload), payload.bytesize, offset, CHUNK_SIZE, 0].pack('a4 N N N n n')
+    offset.step(payload.bytesize - 1, CHUNK_SIZE) do |position|
+      chunk = payload.byteslice(position, CHUNK_SIZE)
+      out << chunk << [Zlib.crc32(chunk)].pack('N')
+    end
+    out
+  end
+end
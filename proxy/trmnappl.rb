@@ -4,121 +4,595 @@ require 'socket'
 require 'net/http'
 require 'json'
 require 'uri'
+require 'digest'
+require_relative 'image_pipeline'
+require_relative 'metrics'
+require_relative 'sender'
+require_relative 'frame_store'
+require_relative 'playlist'
+require_relative 'broadcaster'
+require_relative 'devices'
+require_relative 'upstream_scheduler'
+require_relative 'transfer'
+require_relative 'passthrough'
 
 class TRMNLProxy
   DEFAULT_PORT = 1337
   TRMNL_API_BASE = 'https://usetrmnl.com'
+  # Compact Mac (Plus/SE/Classic) screen
+  DEFAULT_TARGET_WIDTH = 512
+  DEFAULT_TARGET_HEIGHT = 342
+  # How long to wait for a client hello before treating it as a legacy client
+  HELLO_TIMEOUT = 2.0
+  HELLO_MAX_LENGTH = 256
+  DEFAULT_METRICS_PORT = 9337
+  DEFAULT_CACHE_DIR = File.join(__dir__, 'cache')
+  # Used when /api/display doesn't say how long an image is good for
+  DEFAULT_REFRESH_RATE = 300
+  UPSTREAM_TIMEOUT = 15
+  # Subscribed clients get records of a 4-byte type and a 32-bit
+  # big-endian length, followed by that many bytes
+  PUSH_IMAGE = 'IMG '
+  PUSH_HEARTBEAT = 'BEAT'
+  # Announces an image that is about to be broadcast over UDP:
+  # frame_id:32 length:32 chunks:16 reserved:16
+  PUSH_UDP_FRAME = 'UDPF'
+  # How soon the poller tries again after upstream failed
+  POLL_RETRY = 30
+  # Stages a client times its last fetch by, in milliseconds, reported
+  # in its hello as tel=connect,first_byte,receive,decode,blit,free_heap
+  CLIENT_STAGES = %w[connect first_byte receive decode blit].freeze
+  
+  # What a subscribed client was last sent, and how to convert for it.
+  # device is nil in playlist mode.
+  Subscriber = Struct.new(:device, :hello, :format, :digest, :udp)
   
   def initialize(port = DEFAULT_PORT)
     @port = port
-    @access_token = ENV['ACCESS_TOKEN']
+    @api_base = ENV['TRMNL_API_BASE'] || TRMNL_API_BASE
+    @target_width = (ENV['TARGET_WIDTH'] || DEFAULT_TARGET_WIDTH).to_i
+    @target_height = (ENV['TARGET_HEIGHT'] || DEFAULT_TARGET_HEIGHT).to_i
+    @dither = ENV['DITHER'] || 'atkinson'
+    @hello_timeout = (ENV['HELLO_TIMEOUT'] || HELLO_TIMEOUT).to_f
+    @conversions = ImagePipeline::Cache.new
+    @upstream_timeout = (ENV['UPSTREAM_TIMEOUT'] || UPSTREAM_TIMEOUT).to_f
+    # Unset means follow each image's refresh_rate
+    @poll_interval = ENV['POLL_INTERVAL']&.to_i
+    @subscribers = {}.compare_by_identity
+    @subscriber_lock = Mutex.new
+    @next_poll = Hash.new(0).compare_by_identity
     
-    if @access_token.nil? || @access_token.empty?
-      puts "Error: ACCESS_TOKEN environment variable is required"
+    if ENV['PLAYLIST_DIR']
+      # Local frames are already on disk and get held in memory
+      begin
+        @playlist = Playlist.new(ENV['PLAYLIST_DIR'], (ENV['PLAYLIST_DWELL'] || Playlist::DEFAULT_DWELL).to_i)
+      rescue SystemCallError, ArgumentError => e
+        puts "Error: can't load playlist: #{e.message}"
+        exit 1
+      end
+    else
+      cache_dir = ENV['CACHE_DIR'] || DEFAULT_CACHE_DIR
+      begin
+        @devices = Devices.new(ENV['DEVICES_FILE'], ENV['ACCESS_TOKEN'], cache_dir.empty? ? nil : cache_dir)
+      rescue SystemCallError, JSON::ParserError, KeyError => e
+        puts "Error: can't load DEVICES_FILE: #{e.message}"
+        exit 1
+      end
+    end
+    @metrics_port = (ENV['METRICS_PORT'] || DEFAULT_METRICS_PORT).to_i
+    @metrics = Metrics.new
+    describe_metrics
+    @scheduler = UpstreamScheduler.new(
+      @metrics,
+      rate_per_minute: (ENV['API_RATE'] || UpstreamScheduler::DEFAULT_RATE).to_f,
+      burst: (ENV['API_BURST'] || UpstreamScheduler::DEFAULT_BURST).to_i
+    )
+    @sender = Sender.new(
+      @metrics,
+      write_timeout: (ENV['WRITE_TIMEOUT'] || Sender::WRITE_TIMEOUT).to_f,
+      stall_timeout: (ENV['STALL_TIMEOUT'] || Sender::STALL_TIMEOUT).to_f,
+      min_throughput: (ENV['MIN_THROUGHPUT'] || Sender::MIN_THROUGHPUT).to_i,
+      heartbeat_interval: (ENV['HEARTBEAT_INTERVAL'] || Sender::HEARTBEAT_INTERVAL).to_f
+    )
+    if ENV['UDP_BROADCAST']
+      @broadcaster = Broadcaster.new(
+        @metrics,
+        ENV['UDP_BROADCAST'],
+        (ENV['UDP_PORT'] || Broadcaster::DEFAULT_PORT).to_i,
+        interval: (ENV['UDP_CHUNK_INTERVAL'] || Broadcaster::CHUNK_INTERVAL).to_f
+      )
+      if ENV['UDP_PORT'] && ENV['UDP_PORT'].to_i != Broadcaster::DEFAULT_PORT
+        puts "Warning: MacTRMNL listens on UDP port #{Broadcaster::DEFAULT_PORT}; it won't see broadcasts on #{ENV['UDP_PORT']}"
+      end
+    end
+    
+    unless ImagePipeline::DITHER_MODES.include?(@dither)
+      puts "Error: DITHER must be one of #{ImagePipeline::DITHER_MODES.join(', ')}"
+      exit 1
+    end
+    
+    if @playlist.nil? && @devices.empty?
+      puts "Error: ACCESS_TOKEN or DEVICES_FILE environment variable is required"
       exit 1
     end
     
     puts "Starting TRMNL proxy server on port #{@port}"
+    preconvert_playlist if @playlist
+    @devices&.each do |device|
+      next unless device.frame
+      
+      puts "Loaded cached frame #{device.frame.digest[0, 12]} for #{device} fetched #{Time.at(device.frame.fetched_at)}"
+    end
   end
   
   def start
     server = TCPServer.new(@port)
+    MetricsServer.new(@metrics, @metrics_port).start if @metrics_port > 0
+    @sender.start
+    @broadcaster&.start
+    
+    # Warm the cache before the first Mac asks, so it doesn't wait on upstream
+    @devices&.each do |device|
+      Thread.new { current_frame(device) } unless device.frame&.fresh?
+    end
+    Thread.new { poll_upstream }
     
     loop do
-      begin
-        client = server.accept
-        puts "Client connected from #{client.peeraddr[3]}"
-        
-        handle_client(client)
+      client = server.accept
+      # Each client gets a thread for its hello and upstream fetch; the
+      # image itself is written by the sender
+      Thread.new(client) { |c| serve(c) }
+    end
+  end
+  
+  private
+  
+  def describe_metrics
+    @metrics.describe('trmnl_proxy_stage_duration_seconds', :histogram,
+                      'Time spent in each stage of serving a client')
+    @metrics.describe('trmnl_proxy_bytes_sent_total', :counter, 'Image bytes written to clients')
+    @metrics.describe('trmnl_proxy_clients_served_total', :counter, 'Clients sent a complete image')
+    @metrics.describe('trmnl_proxy_errors_total', :counter, 'Errors by type')
+    @metrics.describe('trmnl_proxy_broadcast_bytes_total', :counter, 'UDP broadcast bytes sent, repairs included')
+    @metrics.describe('trmnl_proxy_broadcast_repairs_total', :counter, 'Chunks rebroadcast after a NAK')
+    @metrics.describe('trmnl_proxy_transfer_resumes_total', :counter, 'Interrupted transfers picked up part way')
+    @metrics.describe('trmnl_proxy_upstream_throttled_total', :counter,
+                      'API calls skipped, labelled reason (bucket or backoff)')
+    @metrics.describe('trmnl_client_stage_duration_seconds', :histogram,
+                      'Stage timings each Mac reports for its last image, labelled client and stage')
+    @metrics.describe('trmnl_client_free_heap_bytes', :gauge, 'Free heap each Mac reports after its last image')
+  end
+  
+  def serve(client)
+    peer = client.peeraddr[3]
+    puts "Client connected from #{peer}"
+    
+    handed_off = handle_client(client, peer)
+  rescue => e
+    puts "Error handling client: #{e.message}"
+    puts e.backtrace.join("\n")
+    @metrics.increment('trmnl_proxy_errors_total', type: 'client')
+  ensure
+    unless handed_off
+      client.close
+      puts "Client disconnected"
+    end
+  end
+  
+  # Returns true once the client has been handed to the sender
+  def handle_client(client, peer)
+    hello = read_hello(client)
+    if hello
+      puts "Client hello: #{hello.map { |k, v| "#{k}=#{v}" }.join(' ')}"
+    else
+      puts "No hello from client, using default #{@target_width}x#{@target_height}"
+    end
+    record_telemetry(peer, hello['tel']) if hello && hello['tel']
+    
+    unless @playlist
+      device = @devices.resolve(peer, hello)
+      unless device
+        puts "No device configured for #{peer}"
+        @metrics.increment('trmnl_proxy_errors_total', type: 'unknown_client')
+        return false
+      end
+    end
+    
+    format = choose_format(hello)
+    passthrough = passthrough_for(client, peer, hello, format) if device
+    frame = current_frame(device, tee: passthrough)
+    # Already sent as it downloaded
+    return true if passthrough&.started?
+    return false unless frame
+    
+    return subscribe(client, peer, hello, device, frame, format) if hello && hello['sub'] == '1'
+    return deliver_resumable(client, peer, hello, device, frame, format) if hello && hello['xfer'] == 'crc'
+    
+    if device&.store
+      path = @metrics.time('trmnl_proxy_stage_duration_seconds', stage: 'convert') do
+        cached_variant(device.store, frame, hello, format)
+      end
+      
+      if path
+        puts "Streaming #{format.upcase} data to #{peer} from cache (#{File.size(path)} bytes)..."
+        @sender.deliver_file(client, path, peer)
+        return true
+      end
+    end
+    
+    # No disk cache, or it couldn't be written
+    image_data = @metrics.time('trmnl_proxy_stage_duration_seconds', stage: 'convert') do
+      convert_image(frame.data, hello, format)
+    end
+    return false unless image_data
+    
+    puts "Streaming #{format.upcase} data to #{peer} (#{image_data.length} bytes)..."
+    @sender.deliver(client, image_data, peer)
+    true
+  end
+  
+  # Send a one-shot BMP client its image as it downloads, should it turn
+  # out to need no conversion. That's legacy and hello-less clients only;
+  # MacTRMNL asks for QDBM and either subscribes or takes a checksummed
+  # transfer. QDBM frames are laid out top-down from a bottom-up BMP,
+  # and a checksummed transfer's header carries the frame id, a hash of
+  # the whole image, so both have to wait for the download to finish.
+  def passthrough_for(client, peer, hello, format)
+    return nil if format != 'bmp' || (hello && (hello['sub'] == '1' || hello['xfer'] == 'crc'))
+    
+    Passthrough.new(@sender, client, peer) do |head|
+      width, height = variant_size(head, hello, format)
+      ImagePipeline.passthrough_bmp?(head, width, height)
+    rescue ImagePipeline::UnsupportedImage
+      false
+    end
+  end
+  
+  # Send the image in checksummed chunks, from wherever the client's last
+  # attempt at the same image got to
+  def deliver_resumable(client, peer, hello, device, frame, format)
+    image_data = @metrics.time('trmnl_proxy_stage_duration_seconds', stage: 'convert') do
+      path = device&.store && cached_variant(device.store, frame, hello, format)
+      path ? File.binread(path) : convert_image(frame.data, hello, format)
+    end
+    return false unless image_data
+    
+    id, offset = Transfer.parse_resume(hello['resume'])
+    offset = 0 unless id == Transfer.frame_id(image_data) && offset <= image_data.bytesize
+    offset -= offset % Transfer::CHUNK_SIZE
+    payload = Transfer.framed(image_data, offset)
+    
+    if offset > 0
+      puts "Resuming #{format.upcase} transfer to #{peer} at byte #{offset} of #{image_data.length}..."
+      @metrics.increment('trmnl_proxy_transfer_resumes_total')
+    else
+      puts "Streaming #{format.upcase} data to #{peer} in checksummed chunks (#{image_data.length} bytes)..."
+    end
+    @sender.deliver(client, payload, peer)
+    true
+  end
+  
+  # Send the first image as a push record and keep the connection open;
+  # the poller pushes later images when their hash changes
+  def subscribe(client, peer, hello, device, frame, format)
+    image_data = @metrics.time('trmnl_proxy_stage_duration_seconds', stage: 'convert') do
+      convert_image(frame.data, hello, format)
+    end
+    return false unless image_data
+    
+    puts "Subscribing #{peer} to #{format.upcase} pushes (#{image_data.length} bytes)..."
+    # Held across subscribe so the close callback can't run before we've
+    # recorded the subscriber
+    @subscriber_lock.synchronize do
+      parts = [push_header(PUSH_IMAGE, image_data.bytesize), image_data]
+      connection = @sender.subscribe(client, peer, parts, push_header(PUSH_HEARTBEAT, 0)) do |closed|
+        @subscriber_lock.synchronize { @subscribers.delete(closed) }
+      end
+      @subscribers[connection] = Subscriber.new(device, hello, format, frame.digest, hello['udp'] == '1')
+    end
+    true
+  end
+  
+  def push_header(type, length)
+    [type, length].pack('a4 N')
+  end
+  
+  # For every device someone is subscribed to, refetch on that device's
+  # schedule and push images whose hash has changed. Idle subscribers
+  # only ever see heartbeats.
+  def poll_upstream
+    loop do
+      sleep 1
+      # By identity, like @next_poll; a Device holds its whole frame
+      devices = @subscriber_lock.synchronize { @subscribers.values.map(&:device).uniq(&:object_id) }
+      devices.each do |device|
+        next if Time.now.to_i < @next_poll[device]
         
-      rescue => e
-        puts "Error handling client: #{e.message}"
-        puts e.backtrace.join("\n")
-      ensure
-        client&.close
-        puts "Client disconnected"
+        frame = current_frame(device, @poll_interval)
+        push_frame(device, frame) if frame
+        @next_poll[device] = Time.now.to_i + poll_delay(frame)
       end
+    rescue => e
+      puts "Error polling upstream: #{e.message}"
     end
   end
   
-  private
+  # POLL_INTERVAL if set, otherwise whenever the current image expires
+  def poll_delay(frame)
+    return @poll_interval if @poll_interval
+    
+    remaining = frame ? frame.fetched_at + frame.refresh_rate - Time.now.to_i : 0
+    remaining > 0 ? remaining : POLL_RETRY
+  end
   
-  def handle_client(client)
-    puts "Fetching display data from TRMNL API..."
+  def push_frame(device, frame)
+    stale = @subscriber_lock.synchronize do
+      @subscribers.select { |_, s| s.device.equal?(device) && s.digest != frame.digest }
+    end
+    broadcast = {}
+    stale.each do |connection, subscriber|
+      image_data = convert_image(frame.data, subscriber.hello, subscriber.format)
+      next unless image_data
+      
+      subscriber.digest = frame.digest
+      if subscriber.udp && @broadcaster
+        announce_broadcast(connection, image_data, broadcast)
+      else
+        puts "Pushing new image to #{connection.peer} (#{image_data.length} bytes)..."
+        @sender.push(connection, push_header(PUSH_IMAGE, image_data.bytesize), image_data)
+      end
+    end
+  end
+  
+  # Tell a subscriber which broadcast to pick up. Subscribers sharing a
+  # variant share its frame id, so each push goes out on the wire once;
+  # broadcast holds the ids already sent this time round.
+  def announce_broadcast(connection, image_data, broadcast)
+    id = Transfer.frame_id(image_data)
+    @broadcaster.send_frame(id, image_data) unless broadcast.key?(id)
+    broadcast[id] = true
     
-    display_data = fetch_display_data
-    return unless display_data
+    puts "Announcing broadcast #{format('%08x', id)} to #{connection.peer}"
+    announcement = [id, image_data.bytesize, Broadcaster.chunk_count(image_data), 0].pack('N N n n')
+    @sender.push(connection, push_header(PUSH_UDP_FRAME, announcement.bytesize), announcement, image: false)
+  end
+  
+  # The image a device should show right now. Served from cache until its
+  # refresh_rate (or max_age, if given) runs out; if upstream fails after
+  # that, or the scheduler won't let us call it, the last good image is kept.
+  # tee, if given, sees the image as it downloads (see fetch_image).
+  def current_frame(device, max_age = nil, tee: nil)
+    return @playlist.current if @playlist
+    
+    device.lock.synchronize do
+      current = device.frame
+      if current&.fresh? && (max_age.nil? || Time.now.to_i - current.fetched_at < max_age)
+        return current
+      end
+      
+      frame = fetch_frame(device, tee) if @scheduler.acquire(device.name)
+      if frame
+        device.frame = frame
+        device.store&.save(frame)
+      elsif current
+        puts "Serving #{device} image fetched #{Time.at(current.fetched_at)}"
+      end
+      device.frame
+    end
+  end
+  
+  def fetch_frame(device, tee = nil)
+    puts "Fetching display data for #{device} from TRMNL API..."
+    
+    display_data = @metrics.time('trmnl_proxy_stage_duration_seconds', stage: 'display') do
+      fetch_display_data(device)
+    end
+    return nil unless display_data
     
     image_url = display_data['image_url']
     if image_url.nil? || image_url.empty?
       puts "No image URL in response"
-      return
+      @metrics.increment('trmnl_proxy_errors_total', type: 'no_image_url')
+      return nil
     end
     
     puts "Fetching image from: #{image_url}"
-    image_data = fetch_image(image_url)
-    return unless image_data
+    image_data = @metrics.time('trmnl_proxy_stage_duration_seconds', stage: 'image') do
+      fetch_image(image_url, tee)
+    end
+    return nil unless image_data
+    
+    refresh_rate = display_data['refresh_rate'].to_i
+    refresh_rate = DEFAULT_REFRESH_RATE if refresh_rate <= 0
+    FrameStore::Frame.new(image_data, Digest::SHA1.hexdigest(image_data), refresh_rate, Time.now.to_i, image_url)
+  end
+  
+  # Clients send one line right after connecting:
+  #   TRMNL1 w=512 h=342 buf=65536 enc=qdbm,bmp sub=1 udp=1 dev=office
+  # Older clients (and `nc`) send nothing, so give up after a short wait.
+  def read_hello(client)
+    line = String.new
+    deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + @hello_timeout
+    
+    until line.include?("\n") || line.length >= HELLO_MAX_LENGTH
+      remaining = deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      return nil if remaining <= 0 || !client.wait_readable(remaining)
+      
+      chunk = client.read_nonblock(HELLO_MAX_LENGTH - line.length, exception: false)
+      return nil if chunk.nil?
+      line << chunk unless chunk == :wait_readable
+    end
+    
+    fields = line.strip.split(' ')
+    return nil unless fields.shift == 'TRMNL1'
     
-    puts "Streaming BMP data to client (#{image_data.length} bytes)..."
-    client.write(image_data)
-    puts "Image sent successfully"
+    fields.each_with_object({}) do |field, hello|
+      key, value = field.split('=', 2)
+      hello[key] = value if value
+    end
   end
   
-  def fetch_display_data
-    uri = URI("#{TRMNL_API_BASE}/api/display")
+  # Fold a client's timings for its last fetch into the metrics
+  def record_telemetry(peer, value)
+    fields = value.split(',')
+    return unless fields.length == CLIENT_STAGES.length + 1 && fields.all? { |field| field.match?(/\A\d+\z/) }
     
+    *millis, free_heap = fields.map(&:to_i)
+    CLIENT_STAGES.zip(millis) do |stage, stage_millis|
+      @metrics.observe('trmnl_client_stage_duration_seconds', stage_millis / 1000.0, client: peer, stage: stage)
+    end
+    @metrics.set('trmnl_client_free_heap_bytes', free_heap, client: peer)
+  end
+  
+  # First encoding in the client's list that we can produce; legacy
+  # clients only understand BMP
+  def choose_format(hello)
+    encodings = hello && hello['enc'] ? hello['enc'].split(',') : []
+    encodings.find { |enc| ImagePipeline::FORMATS.include?(enc) } || 'bmp'
+  end
+  
+  # Largest size the client can both show and receive in one piece; `buf`
+  # is its receive slot. Older clients send `mem` instead and needed an
+  # offscreen copy of a BMP while drawing it, so they get half of that.
+  def variant_size(image_data, hello, format)
+    max_width = @target_width
+    max_height = @target_height
+    budget = nil
+    
+    if hello
+      max_width = hello['w'].to_i if hello['w'].to_i > 0
+      max_height = hello['h'].to_i if hello['h'].to_i > 0
+      budget = hello['buf'].to_i if hello['buf'].to_i > 0
+      if hello['mem'].to_i > 0
+        mem = format == 'qdbm' ? hello['mem'].to_i : hello['mem'].to_i / 2
+        budget = [budget || Float::INFINITY, mem].min
+      end
+    end
+    
+    source_width, source_height = ImagePipeline.dimensions(image_data)
+    width, height = ImagePipeline.fit_size(source_width, source_height, max_width, max_height)
+    while budget && ImagePipeline.frame_size(format, width, height) > budget && width > 1 && height > 1
+      width, height = ImagePipeline.fit_size(source_width, source_height, width * 9 / 10, height * 9 / 10)
+    end
+    
+    [width, height]
+  end
+  
+  # Convert every playlist frame for clients without a hello, in both wire
+  # formats, so serving them is a plain copy from memory
+  def preconvert_playlist
+    @conversions = ImagePipeline::Cache.new([ImagePipeline::Cache::DEFAULT_CAPACITY,
+                                             @playlist.frames.length * ImagePipeline::FORMATS.length * 2].max)
+    @playlist.frames.each do |frame|
+      ImagePipeline::FORMATS.each { |format| convert_image(frame.data, nil, format) }
+    end
+  end
+  
+  # Path of the converted image in the disk cache, converting it first if
+  # needed. The conversion itself is shared with other devices.
+  def cached_variant(store, frame, hello, format)
+    width, height = variant_size(frame.data, hello, format)
+    store.variant(frame.digest, width, height, format) do
+      convert_image(frame.data, hello, format)
+    end
+  rescue ImagePipeline::UnsupportedImage => e
+    puts "Error converting image: #{e.message}"
+    nil
+  end
+  
+  def convert_image(image_data, hello, format)
+    width, height = variant_size(image_data, hello, format)
+    
+    @conversions.fetch(image_data, width, height, format) do
+      puts "Converting image to #{format.upcase} for #{width}x#{height}..."
+      ImagePipeline.convert(image_data, width, height, format: format, dither: @dither)
+    end
+  rescue ImagePipeline::UnsupportedImage, Zlib::Error => e
+    puts "Error converting image: #{e.message}"
+    @metrics.increment('trmnl_proxy_errors_total', type: 'convert')
+    nil
+  end
+  
+  def upstream_http(uri)
     http = Net::HTTP.new(uri.host, uri.port)
-    http.use_ssl = true
+    http.use_ssl = (uri.scheme == 'https')
+    http.open_timeout = @upstream_timeout
+    http.read_timeout = @upstream_timeout
+    http
+  end
+  
+  def fetch_display_data(device)
+    uri = URI("#{@api_base}/api/display")
+    
+    http = upstream_http(uri)
     
     request = Net::HTTP::Get.new(uri)
-    request['Access-Token'] = @access_token
+    request['Access-Token'] = device.access_token
     
     response = http.request(request)
     
     if response.code == '200'
+      @scheduler.succeeded(device.name)
       JSON.parse(response.body)
     else
       puts "API request failed: #{response.code} #{response.message}"
       puts response.body
+      @metrics.increment('trmnl_proxy_errors_total', type: "api_#{response.code}")
+      @scheduler.failed(device.name, response.code, response['Retry-After'])
       nil
     end
   rescue => e
     puts "Error fetching display data: #{e.message}"
+    @metrics.increment('trmnl_proxy_errors_total', type: 'api')
+    @scheduler.failed(device.name, e.class.name)
     nil
   end
   
-  def fetch_image(image_url)
+  # tee, if given, is fed the image body chunk by chunk as it arrives, then
+  # told whether it finished or failed
+  def fetch_image(image_url, tee = nil)
     uri = URI(image_url)
     
-    http = Net::HTTP.new(uri.host, uri.port)
-    http.use_ssl = (uri.scheme == 'https')
+    http = upstream_http(uri)
     
     request = Net::HTTP::Get.new(uri)
     
     # Follow redirects
     5.times do
-      response = http.request(request)
+      body = String.new(encoding: Encoding::BINARY)
+      response = http.request(request) do |res|
+        next unless res.code == '200'
+        
+        res.read_body do |chunk|
+          body << chunk
+          tee << chunk if tee
+        end
+      end
       
       case response.code
       when '200'
-        return response.body
+        tee&.finish
+        return body
       when '301', '302', '303', '307', '308'
         redirect_url = response['location']
         puts "Following redirect to: #{redirect_url}"
         uri = URI(redirect_url)
-        http = Net::HTTP.new(uri.host, uri.port)
-        http.use_ssl = (uri.scheme == 'https')
+        http = upstream_http(uri)
         request = Net::HTTP::Get.new(uri)
       else
         puts "Image fetch failed: #{response.code} #{response.message}"
+        @metrics.increment('trmnl_proxy_errors_total', type: "image_#{response.code}")
         return nil
       end
     end
     
     puts "Too many redirects"
+    @metrics.increment('trmnl_proxy_errors_total', type: 'image_redirects')
     nil
   rescue => e
     puts "Error fetching image: #{e.message}"
+    @metrics.increment('trmnl_proxy_errors_total', type: 'image')
+    tee&.abort
     nil
   end
 end
\ No newline at end of file
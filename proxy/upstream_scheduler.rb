@@ -0,0 +1,88 @@
+require 'time'
+
+# Decides when the proxy may call /api/display. Calls from every client
+# and device draw from one token bucket, so a crowd of Macs can't burn
+# through the API quota, and a device that has been rate limited or is
+# failing is left alone until its Retry-After (or an exponential backoff)
+# has passed. Callers serve their cached frame whenever a call is refused.
+class UpstreamScheduler
+  # Sustained /api/display calls per minute, across all devices
+  DEFAULT_RATE = 6
+  # Calls that can be made back to back after a quiet spell
+  DEFAULT_BURST = 3
+  # Backoff after a failure without Retry-After, doubled for each
+  # further failure in a row
+  BACKOFF = 30
+  MAX_BACKOFF = 900
+
+  def initialize(metrics, rate_per_minute: DEFAULT_RATE, burst: DEFAULT_BURST)
+    @metrics = metrics
+    @rate = rate_per_minute / 60.0
+    @burst = burst.to_f
+    @tokens = @burst
+    @refilled_at = Metrics.now
+    @blocked_until = Hash.new(0.0)
+    @failures = Hash.new(0)
+    @lock = Mutex.new
+  end
+
+  # True if key may call upstream now, taking a token if so
+  def acquire(key)
+    @lock.synchronize do
+      now = Metrics.now
+      refill(now)
+
+      if now < @blocked_until[key]
+        refuse(key, 'backoff', "backing off for another #{(@blocked_until[key] - now).ceil}s")
+      elsif @tokens < 1
+        refuse(key, 'bucket', "API budget spent, next call in #{((1 - @tokens) / @rate).ceil}s")
+      else
+        @tokens -= 1
+        true
+      end
+    end
+  end
+
+  def succeeded(key)
+    @lock.synchronize do
+      puts "Upstream recovered for #{key}" if @failures[key] > 0
+      @failures.delete(key)
+      @blocked_until.delete(key)
+    end
+  end
+
+  # Back off after a failed call, for as long as retry_after (a
+  # Retry-After header value) asks if there is one
+  def failed(key, status, retry_after = nil)
+    @lock.synchronize do
+      @failures[key] += 1
+      delay = parse_retry_after(retry_after) ||
+              [BACKOFF * 2**(@failures[key] - 1), MAX_BACKOFF].min
+      @blocked_until[key] = Metrics.now + delay
+      puts "Upstream throttle for #{key}: #{status}, failure #{@failures[key]} in a row, " \
+           "next call in #{delay.ceil}s (#{@tokens.round(1)}/#{@burst.round} tokens)"
+    end
+  end
+
+  private
+
+  def refill(now)
+    @tokens = [@tokens + (now - @refilled_at) * @rate, @burst].min
+    @refilled_at = now
+  end
+
+  def refuse(key, reason, detail)
+    puts "Not calling upstream for #{key}: #{detail}"
+    @metrics.increment('trmnl_proxy_upstream_throttled_total', reason: reason)
+    false
+  end
+
+  def parse_retry_after(value)
+    return nil if value.nil? || value.strip.empty?
+    return value.to_i if value.strip.match?(/\A\d+\z/)
+
+    [Time.httpdate(value) - Time.now, 0].max
+  rescue ArgumentError
+    nil
+  end
+end
@@ -0,0 +1,76 @@
+/*
+ * Arena.c
+ *
+ * Fixed buffers for MacTRMNL
+ * Sizes the slots from the screen and what the heap can spare, then
+ * allocates them together, low in the heap, before anything else can
+ * land in the middle of it
+ *
+ * Written by Erik Reynolds
+ * v20250702-1
+ */
+
+#include <Memory.h>
+#include <stdio.h>
+#include "Arena.h"
+#include "FrameFormat.h"
+#include "Logging.h"
+
+Arena gArena;
+
+// Keep every slot long-aligned
+#define SlotSize(size)      (((size) + 3) & ~3L)
+
+OSErr InitArena(short screenWidth, short screenHeight) {
+    long fixed;
+    long receiveSize;
+    long total;
+    Ptr next;
+    char message[96];
+
+    // A decoded frame is a screen-sized BitMap behind a QDBM header. We
+    // keep two, the one on screen and the one being decoded into.
+    gArena.frameSize = SlotSize(sizeof(QDFrameHeader) +
+                                ((screenWidth + 15) / 16) * 2L * screenHeight);
+    fixed = 2 * gArena.frameSize + kRcvBufferSize + kUDPBufferSize;
+
+    // The receive slot gets whatever is left, up to the largest frame we
+    // ask for; hello tells the proxy how big that is. It needn't hold a
+    // screenful: frames are scaled straight out of it, and the proxy
+    // sends a smaller one if a full-screen frame won't fit. On a 1024x768
+    // screen each frame slot is 98,324 bytes, so with a 64 KB receive
+    // slot the arena takes about 280 KB, plus the headroom.
+    receiveSize = MaxBlock() - kArenaHeadroom - fixed;
+    if (receiveSize > kMaxBMPSize) {
+        receiveSize = kMaxBMPSize;
+    }
+    receiveSize &= ~3L;
+    if (receiveSize < kMinReceiveSize) {
+        LogError("Not enough memory for frame buffers");
+        return memFullErr;
+    }
+    gArena.receiveSize = receiveSize;
+    total = fixed + receiveSize;
+
+    ReserveMem(total);
+    gArena.block = NewPtr(total);
+    if (gArena.block == NULL) {
+        LogError("Couldn't allocate frame buffers");
+        return MemError();
+    }
+
+    next = gArena.block;
+    gArena.receive = next;
+    next += gArena.receiveSize;
+    gArena.frame[0] = next;
+    next += gArena.frameSize;
+    gArena.frame[1] = next;
+    next += gArena.frameSize;
+    gArena.tcpBuffer = next;
+    next += kRcvBufferSize;
+    gArena.udpBuffer = next;
+
+    sprintf(message, "Frame buffers: %ld bytes, frames up to %ld bytes", total, receiveSize);
+    LogInfo(message);
+    return noErr;
+}
@@ -0,0 +1,39 @@
+/*
+ * Arena.h
+ *
+ * Fixed buffers for MacTRMNL
+ * Every frame and network buffer is carved out of one block allocated
+ * at startup, so refreshing never calls the Memory Manager and can't
+ * fragment the heap
+ *
+ * Written by Erik Reynolds
+ * v20250702-1
+ */
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <Types.h>
+
+#define kMaxBMPSize         65536L  // Largest frame we ever ask for
+#define kRcvBufferSize      8192    // MacTCP's buffer for our TCP stream
+#define kUDPBufferSize      16384   // MacTCP wants room for two datagrams, plus some
+#define kArenaHeadroom      32768L  // Left free for windows, dialogs and the toolbox
+#define kMinReceiveSize     16384L  // Smallest receive slot worth asking the proxy to fill
+
+typedef struct {
+    Ptr block;              // The one allocation the rest live in
+    Ptr receive;            // Frames land here off the network
+    long receiveSize;
+    Ptr frame[2];           // Decoded QDBM frames, front and back, in turn
+    long frameSize;
+    Ptr tcpBuffer;          // kRcvBufferSize
+    Ptr udpBuffer;          // kUDPBufferSize
+} Arena;
+
+extern Arena gArena;
+
+/* Function Prototypes */
+OSErr InitArena(short screenWidth, short screenHeight);
+
+#endif /* __ARENA_H__ */
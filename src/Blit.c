@@ -0,0 +1,64 @@
+/*
+ * Blit.c
+ *
+ * Frame conversion kernels for MacTRMNL
+ * Picks the kernels for the CPU we're on, and has the 68000 ones,
+ * which also run on the 68010. The 68020 ones are in Blit020.c.
+ *
+ * Written by Erik Reynolds
+ * v20250702-1
+ */
+
+#include <Memory.h>
+#include <Gestalt.h>
+#include <stdio.h>
+#include "Blit.h"
+#include "Logging.h"
+
+BlitKernels gBlit = { InvertRow000, CopyBytes000, "68000" };
+
+void InitBlit(void) {
+    long cpu;
+#if LOG_COMPILED_LEVEL >= kLogLevelDebug
+    char message[48];
+#endif
+
+    if (Gestalt(gestaltProcessorType, &cpu) == noErr && cpu >= gestalt68020) {
+        gBlit.invertRow = InvertRow020;
+        gBlit.copyBytes = CopyBytes020;
+        gBlit.name = "68020";
+    }
+
+#if LOG_COMPILED_LEVEL >= kLogLevelDebug
+    sprintf(message, "Using %s frame kernels", gBlit.name);
+    LogDebug(message);
+#endif
+}
+
+// The 68000 only reads words and longs at even addresses, so take rows
+// a long at a time when both ends are even and a byte at a time if not
+void InvertRow000(const unsigned char *src, unsigned char *dest, short bytes) {
+    const unsigned long *srcLong;
+    unsigned long *destLong;
+    short longs;
+
+    if ((((long)src | (long)dest) & 1) == 0) {
+        srcLong = (const unsigned long *)src;
+        destLong = (unsigned long *)dest;
+        for (longs = bytes >> 2; longs > 0; longs--) {
+            *destLong++ = ~*srcLong++;
+        }
+        src = (const unsigned char *)srcLong;
+        dest = (unsigned char *)destLong;
+        bytes &= 3;
+    }
+
+    while (bytes-- > 0) {
+        *dest++ = ~*src++;
+    }
+}
+
+// BlockMove is as quick as anything we'd write for the 68000
+void CopyBytes000(const void *src, void *dest, long bytes) {
+    BlockMove((Ptr)src, (Ptr)dest, bytes);
+}
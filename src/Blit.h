@@ -0,0 +1,37 @@
+/*
+ * Blit.h
+ *
+ * Frame conversion kernels for MacTRMNL
+ * Each kernel is built twice, for the 68000 and for the 68020 and up,
+ * and InitBlit picks the set to use from Gestalt
+ *
+ * Written by Erik Reynolds
+ * v20250702-1
+ */
+
+#ifndef __BLIT_H__
+#define __BLIT_H__
+
+#include <Types.h>
+
+typedef void (*InvertRowProc)(const unsigned char *src, unsigned char *dest, short bytes);
+typedef void (*CopyBytesProc)(const void *src, void *dest, long bytes);
+
+typedef struct {
+    InvertRowProc invertRow;    // A BMP row to a BitMap row; 1 is white in one, black in the other
+    CopyBytesProc copyBytes;    // A QDBM frame into a frame slot
+    const char *name;
+} BlitKernels;
+
+extern BlitKernels gBlit;
+
+/* Function Prototypes */
+void InitBlit(void);
+
+/* The kernels themselves; call them through gBlit */
+void InvertRow000(const unsigned char *src, unsigned char *dest, short bytes);
+void CopyBytes000(const void *src, void *dest, long bytes);
+void InvertRow020(const unsigned char *src, unsigned char *dest, short bytes);
+void CopyBytes020(const void *src, void *dest, long bytes);
+
+#endif /* __BLIT_H__ */
@@ -0,0 +1,66 @@
+/*
+ * Blit020.c
+ *
+ * Frame conversion kernels for the 68020 and up
+ * Built with -m68020 (see CMakeLists.txt), so only call these once
+ * InitBlit has checked the CPU. They take unaligned longs, which the
+ * 68020 allows, and do four per pass so the loop overhead is small
+ * and the loop still fits in the instruction cache.
+ *
+ * Written by Erik Reynolds
+ * v20250702-1
+ */
+
+#include "Blit.h"
+
+void InvertRow020(const unsigned char *src, unsigned char *dest, short bytes) {
+    const unsigned long *srcLong = (const unsigned long *)src;
+    unsigned long *destLong = (unsigned long *)dest;
+    short blocks;
+
+    for (blocks = bytes >> 4; blocks > 0; blocks--) {
+        destLong[0] = ~srcLong[0];
+        destLong[1] = ~srcLong[1];
+        destLong[2] = ~srcLong[2];
+        destLong[3] = ~srcLong[3];
+        srcLong += 4;
+        destLong += 4;
+    }
+    for (blocks = (bytes >> 2) & 3; blocks > 0; blocks--) {
+        *destLong++ = ~*srcLong++;
+    }
+
+    src = (const unsigned char *)srcLong;
+    dest = (unsigned char *)destLong;
+    for (bytes &= 3; bytes > 0; bytes--) {
+        *dest++ = ~*src++;
+    }
+}
+
+// BlockMove flushes the caches on a 68040 under System 7, which costs
+// more than the copy; frames are data, so there's nothing to flush
+void CopyBytes020(const void *src, void *dest, long bytes) {
+    const unsigned long *srcLong = (const unsigned long *)src;
+    unsigned long *destLong = (unsigned long *)dest;
+    const unsigned char *srcByte;
+    unsigned char *destByte;
+    long blocks;
+
+    for (blocks = bytes >> 4; blocks > 0; blocks--) {
+        destLong[0] = srcLong[0];
+        destLong[1] = srcLong[1];
+        destLong[2] = srcLong[2];
+        destLong[3] = srcLong[3];
+        srcLong += 4;
+        destLong += 4;
+    }
+    for (blocks = (bytes >> 2) & 3; blocks > 0; blocks--) {
+        *destLong++ = *srcLong++;
+    }
+
+    srcByte = (const unsigned char *)srcLong;
+    destByte = (unsigned char *)destLong;
+    for (bytes &= 3; bytes > 0; bytes--) {
+        *destByte++ = *srcByte++;
+    }
+}
@@ -0,0 +1,82 @@
+/*
+ * FrameFormat.h
+ * 
+ * Wire formats for images sent by the proxy
+ * A frame is either a 1-bit BMP or a QDBM frame: a QuickDraw BitMap
+ * with a small header, drawn with CopyBits straight from the buffer
+ * 
+ * Written by Erik Reynolds
+ * v20250702-1
+ */
+
+#ifndef __FRAMEFORMAT_H__
+#define __FRAMEFORMAT_H__
+
+#include <Types.h>
+
+#define kQDFrameMagic       'QDBM'
+#define kQDFrameVersion     1
+
+// QDBM header, big-endian like the 68k itself. 20 bytes, so the pixel
+// data that follows stays word-aligned for CopyBits.
+typedef struct {
+    long magic;         // kQDFrameMagic
+    short version;      // kQDFrameVersion
+    short rowBytes;     // Always even
+    Rect bounds;        // Top-left is 0,0
+    long dataLength;    // Bytes of pixel data after the header
+} QDFrameHeader;
+
+// Records on a subscribed connection (hello sub=1). The proxy sends an
+// image record whenever the image changes and a heartbeat when idle;
+// the client answers each heartbeat with one of its own.
+#define kPushImageRecord    'IMG '
+#define kPushHeartbeat      'BEAT'
+#define kPushUDPFrame       'UDPF'
+
+typedef struct {
+    long type;          // kPushImageRecord, kPushHeartbeat or kPushUDPFrame
+    long length;        // Bytes that follow
+} PushRecordHeader;
+
+// Body of a kPushUDPFrame record: this frame is about to be broadcast
+typedef struct {
+    long frameId;
+    long length;        // Bytes in the whole frame
+    short chunkCount;
+    short reserved;
+} UDPFrameAnnounce;
+
+// Broadcast frames arrive as chunks of kUDPChunkSize bytes (the last
+// may be shorter), each with this header. A client missing some sends
+// the proxy kUDPNakMagic, frameId, chunkCount and a bitmap with a bit
+// set for each missing chunk, most significant bit first.
+#define kUDPChunkMagic      'TRMB'
+#define kUDPNakMagic        'TRMN'
+#define kUDPChunkSize       512
+
+typedef struct {
+    long magic;         // kUDPChunkMagic
+    long frameId;
+    long length;        // Bytes in the whole frame
+    short index;
+    short count;
+} UDPChunkHeader;
+
+// Resumable transfer (hello xfer=crc). The frame follows this header in
+// chunks of chunkSize bytes (the last may be shorter), each followed by
+// the CRC-32 of its bytes. After a dropped link the client reconnects
+// with resume=<frameId>:<offset> and the proxy starts from there, or
+// from 0 if that frame is no longer current.
+#define kTransferMagic      'XFER'
+
+typedef struct {
+    long magic;         // kTransferMagic
+    long frameId;
+    long length;        // Bytes in the whole frame
+    long offset;        // Where the chunks that follow start
+    short chunkSize;
+    short reserved;
+} TransferHeader;
+
+#endif /* __FRAMEFORMAT_H__ */
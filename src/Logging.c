@@ -10,31 +10,66 @@
 
 #include <Files.h>
 #include <OSUtils.h>
+#include <Memory.h>
 #include <string.h>
 #include <stdio.h>
 #include "Logging.h"
 
-// Logging functions
-OSErr InitLogging(void) {
+// Lines collect here and go to disk when the app is idle, so a log call
+// on the network or drawing path costs a copy rather than an FSWrite
+#define kLogRingSize        4096
+#define kLogHighWater       3072   // Flush everything once this full
+
+#define kLogFileName        "\pMacTrmnl Log"
+#define kLogOldFileName     "\pMacTrmnl Log.old"
+
+short gLogLevel = kLogLevelInfo;
+long gLogMaxSize = kLogDefaultMaxSize;
+
+static long gLogFileSize = 0;
+
+static char gLogRing[kLogRingSize];
+static long gLogHead = 0;   // Where the next line goes
+static long gLogUsed = 0;   // Bytes not yet written to disk
+
+// Open the log file, creating it if need be, ready to append
+static OSErr OpenLogFile(void) {
     OSErr err;
-    Str255 fileName;
-    long count;
-    
-    // Initialize Pascal string
-    strcpy((char*)fileName, "\pMacTrmnl Log");
     
     // Create and open log file
-    err = Create(fileName, 0, 'TEXT', 'ttxt');
+    err = Create(kLogFileName, 0, 'TEXT', 'ttxt');
     // Ignore error if file already exists
     
     // Open the file
-    err = FSOpen(fileName, 0, &gLogFileRefNum);
+    err = FSOpen(kLogFileName, 0, &gLogFileRefNum);
     if (err != noErr) {
+        gLogFileRefNum = 0;
         return err;
     }
     
     // Move to end of file for appending
-    err = SetFPos(gLogFileRefNum, fsFromLEOF, 0);
+    GetEOF(gLogFileRefNum, &gLogFileSize);
+    return SetFPos(gLogFileRefNum, fsFromLEOF, 0);
+}
+
+// Keep the full log as the one .old generation and start a new one, so
+// an unattended Mac never uses more than twice gLogMaxSize
+static void RotateLog(void) {
+    FSClose(gLogFileRefNum);
+    gLogFileRefNum = 0;
+    FSDelete(kLogOldFileName, 0);
+    Rename(kLogFileName, 0, kLogOldFileName);
+    OpenLogFile();
+}
+
+// Logging functions
+OSErr InitLogging(void) {
+    OSErr err;
+    
+    err = OpenLogFile();
+    if (err != noErr) {
+        return err;
+    }
     
     // Log startup message
     LogInfo("MacTRMNL Started");
@@ -45,38 +80,91 @@ OSErr InitLogging(void) {
 void LogMessage(const char *prefix, const char *message) {
     char buffer[256];
     long count;
-    unsigned long ticks;
-    int hours, minutes, seconds;
+    unsigned long now;
+    DateTimeRec date;
     int len;
     int i;
     
     if (gLogFileRefNum == 0) return;
     
-    // Get current time
-    ticks = TickCount();
-    seconds = (ticks / 60) % 60;
-    minutes = (ticks / 3600) % 60;
-    hours = (ticks / 216000) % 24;
+    // Stamp it with the clock time, so lines can be matched up with the
+    // proxy's log
+    GetDateTime(&now);
+    SecondsToDate(now, &date);
+    sprintf(buffer, "[%04d-%02d-%02d %02d:%02d:%02d] %s: %s\r",
+            date.year, date.month, date.day, date.hour, date.minute, date.second,
+            prefix, message);
     
-    // Format message with timestamp
-    sprintf(buffer, "[%02d:%02d:%02d] %s: %s\r", hours, minutes, seconds, prefix, message);
-    
-    // Write to file
+    // Queue it, making room first if the ring is full
     count = strlen(buffer);
-    FSWrite(gLogFileRefNum, &count, buffer);
+    if (gLogUsed + count > kLogRingSize) {
+        FlushLog(kLogRingSize);
+    }
+    
+    len = kLogRingSize - gLogHead;
+    if (len > count) {
+        len = count;
+    }
+    BlockMove(buffer, gLogRing + gLogHead, len);
+    BlockMove(buffer + len, gLogRing, count - len);
+    gLogHead = (gLogHead + count) % kLogRingSize;
+    gLogUsed += count;
+    
+    if (gLogUsed >= kLogHighWater) {
+        FlushLog(kLogRingSize);
+    }
 }
 
-void LogError(const char *message) {
-    LogMessage("ERROR", message);
+// Write up to budget bytes of queued lines to disk
+void FlushLog(long budget) {
+    long tail;
+    long count;
+    
+    if (gLogFileRefNum == 0) return;
+    
+    while (gLogUsed > 0 && budget > 0) {
+        // Oldest bytes first, up to where the ring wraps
+        tail = (gLogHead - gLogUsed + kLogRingSize) % kLogRingSize;
+        count = kLogRingSize - tail;
+        if (count > gLogUsed) {
+            count = gLogUsed;
+        }
+        if (count > budget) {
+            count = budget;
+        }
+        
+        if (gLogMaxSize > 0 && gLogFileSize > 0 && gLogFileSize + count > gLogMaxSize) {
+            RotateLog();
+        }
+        
+        if (gLogFileRefNum == 0 || FSWrite(gLogFileRefNum, &count, gLogRing + tail) != noErr) {
+            // Disk full or gone; drop what's queued rather than retry forever
+            gLogUsed = 0;
+            return;
+        }
+        gLogFileSize += count;
+        gLogUsed -= count;
+        budget -= count;
+    }
+}
+
+void LogAt(short level, const char *message) {
+    static const char *prefixes[] = { "", "ERROR", "WARN", "INFO", "DEBUG", "TRACE" };
+    
+    if (level > gLogLevel) return;
+    LogMessage(prefixes[level], message);
 }
 
-void LogInfo(const char *message) {
-    LogMessage("INFO", message);
+// A one-line summary of each refresh, written at every level, so even a
+// kiosk logging only errors shows it is alive
+void LogSummary(const char *message) {
+    LogMessage("SUMMARY", message);
 }
 
 void CloseLog(void) {
     if (gLogFileRefNum != 0) {
         LogInfo("MacTRMNL Closing");
+        FlushLog(kLogRingSize);
         FSClose(gLogFileRefNum);
         FlushVol(NULL, 0);
         gLogFileRefNum = 0;
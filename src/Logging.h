@@ -17,11 +17,67 @@
 // External reference to log file handle (defined in mactrmnl.c)
 extern short gLogFileRefNum;
 
+// Most bytes of queued log lines written per pass of the event loop
+#define kLogFlushBudget     512
+
+// Log levels, most severe first
+#define kLogLevelError      1
+#define kLogLevelWarn       2
+#define kLogLevelInfo       3
+#define kLogLevelDebug      4
+#define kLogLevelTrace      5
+
+// Least severe level compiled in at all. Release builds of MacTRMNL set
+// this to kLogLevelInfo (see CMakeLists.txt), so debug and trace calls
+// cost no code or cycles there.
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL  kLogLevelTrace
+#endif
+
+// Least severe level written, from preferences
+extern short gLogLevel;
+
+// Once the log reaches gLogMaxSize bytes it is renamed "MacTrmnl Log.old",
+// replacing the last one, and a new log started. 0 for no limit.
+#define kLogDefaultMaxSize  65536L
+extern long gLogMaxSize;
+
 /* Function Prototypes */
 OSErr InitLogging(void);
 void LogMessage(const char *prefix, const char *message);
-void LogError(const char *message);
-void LogInfo(const char *message);
+void LogAt(short level, const char *message);
+void LogSummary(const char *message);
+void FlushLog(long budget);
 void CloseLog(void);
 
+#if LOG_COMPILED_LEVEL >= kLogLevelError
+#define LogError(message)   LogAt(kLogLevelError, message)
+#else
+#define LogError(message)   ((void)0)
+#endif
+
+#if LOG_COMPILED_LEVEL >= kLogLevelWarn
+#define LogWarn(message)    LogAt(kLogLevelWarn, message)
+#else
+#define LogWarn(message)    ((void)0)
+#endif
+
+#if LOG_COMPILED_LEVEL >= kLogLevelInfo
+#define LogInfo(message)    LogAt(kLogLevelInfo, message)
+#else
+#define LogInfo(message)    ((void)0)
+#endif
+
+#if LOG_COMPILED_LEVEL >= kLogLevelDebug
+#define LogDebug(message)   LogAt(kLogLevelDebug, message)
+#else
+#define LogDebug(message)   ((void)0)
+#endif
+
+#if LOG_COMPILED_LEVEL >= kLogLevelTrace
+#define LogTrace(message)   LogAt(kLogLevelTrace, message)
+#else
+#define LogTrace(message)   ((void)0)
+#endif
+
 #endif /* __LOGGING_H__ */
\ No newline at end of file
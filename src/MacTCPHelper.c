@@ -12,17 +12,21 @@
 #include <Memory.h>
 #include <Devices.h>
 #include <Gestalt.h>
+#include <string.h>
 #include "MacTCPHelper.h"
+#include "FrameFormat.h"
 #include "logging.h"
+#include "Timing.h"
+#include "Arena.h"
 
-// Constants from main application
-#define kRcvBufferSize 		8192
-#define kMaxBMPSize			65536L
+#define kTCPStateEstablished    8   // TCPStatus connectionState
 
 // TCP globals
 StreamPtr tcpStream = 0;
 Boolean gHaveMacTCP = false;
 short gTCPDriverRefNum = 0;  // MacTCP driver reference number
+TimingMark gFirstDataMark;   // When data first arrived since gGotFirstData was cleared
+Boolean gGotFirstData = false;
 
 // Helper function for MacTCP control calls
 OSErr DoTCPControl(TCPiopb *pb) {
@@ -142,16 +146,33 @@ OSErr ParseIPAddress(const char *ipString, ip_addr *ipAddr) {
     return noErr;
 }
 
-OSErr ConnectToServer(ip_addr serverIP, unsigned short serverPort, StreamPtr *stream) {
+// Release a stream, aborting any connection it still has. Its receive
+// buffer is MacTCP's until this is done.
+static void ReleaseTCPStream(StreamPtr stream) {
+    TCPiopb pb;
+    
+    pb.ioCompletion = NULL;
+    pb.ioCRefNum = gTCPDriverRefNum;
+    pb.csCode = TCPRelease;
+    pb.tcpStream = stream;
+    
+    DoTCPControl(&pb);
+}
+
+OSErr ConnectToServer(ip_addr serverIP, unsigned short serverPort, StreamPtr *stream, const char *hello) {
     OSErr err;
     TCPiopb pb;
     tcp_port localPort = 0;  // Let MacTCP assign
+    StreamPtr newStream;
+    
+    *stream = NULL;
     
     // Create stream
     pb.ioCompletion = NULL;
     pb.ioCRefNum = gTCPDriverRefNum;
     pb.csCode = TCPCreate;
-    pb.csParam.create.rcvBuff = (Ptr)NewPtr(kRcvBufferSize);
+    // One stream at a time, so they can all use the same buffer
+    pb.csParam.create.rcvBuff = gArena.tcpBuffer;
     pb.csParam.create.rcvBuffLen = kRcvBufferSize;
     pb.csParam.create.notifyProc = NULL;
     pb.csParam.create.userDataPtr = NULL;
@@ -161,11 +182,11 @@ OSErr ConnectToServer(ip_addr serverIP, unsigned short serverPort, StreamPtr *st
         return err;
     }
     
-    *stream = pb.tcpStream;
+    newStream = pb.tcpStream;
     
     // Debug: Show stream value
-    if (*stream != 0) {
-        LogInfo("TCP stream created");
+    if (newStream != 0) {
+        LogDebug("TCP stream created");
     } else {
         LogError("Failed to create stream");
         return -1;
@@ -175,7 +196,7 @@ OSErr ConnectToServer(ip_addr serverIP, unsigned short serverPort, StreamPtr *st
     pb.ioCompletion = NULL;
     pb.ioCRefNum = gTCPDriverRefNum;
     pb.csCode = TCPActiveOpen;
-    pb.tcpStream = *stream;
+    pb.tcpStream = newStream;
     pb.csParam.open.ulpTimeoutValue = 30;  // 30 second timeout
     pb.csParam.open.ulpTimeoutAction = 1;  // Abort on timeout
     pb.csParam.open.validityFlags = 0;
@@ -201,198 +222,265 @@ OSErr ConnectToServer(ip_addr serverIP, unsigned short serverPort, StreamPtr *st
         }
     }
     
-    return err;
+    // Tell the proxy what we can display so it sizes the image for us
+    if (err == noErr && hello != NULL) {
+        err = SendTCPData(newStream, (Ptr)hello, strlen(hello));
+        if (err != noErr) {
+            LogError("Failed to send hello");
+        }
+    }
+    
+    // Callers only ever see a connected stream. A failed one is released
+    // here, before the next TCPCreate hands its buffer out again.
+    if (err != noErr) {
+        ReleaseTCPStream(newStream);
+        return err;
+    }
+    
+    *stream = newStream;
+    return noErr;
+}
+
+OSErr SendTCPData(StreamPtr stream, Ptr data, unsigned short length) {
+    TCPiopb pb;
+    wdsEntry wds[2];
+    
+    // Write data structure: one buffer, terminated by a zero-length entry
+    wds[0].length = length;
+    wds[0].ptr = data;
+    wds[1].length = 0;
+    wds[1].ptr = NULL;
+    
+    pb.ioCompletion = NULL;
+    pb.ioCRefNum = gTCPDriverRefNum;
+    pb.csCode = TCPSend;
+    pb.tcpStream = stream;
+    pb.csParam.send.ulpTimeoutValue = 30;
+    pb.csParam.send.ulpTimeoutAction = 1;
+    pb.csParam.send.validityFlags = 0;
+    pb.csParam.send.pushFlag = true;
+    pb.csParam.send.urgentFlag = false;
+    pb.csParam.send.wdsPtr = (Ptr)wds;
+    pb.csParam.send.userDataPtr = NULL;
+    
+    return DoTCPControl(&pb);
 }
 
-OSErr ReceiveBMPData(StreamPtr stream, Ptr *bmpData, long *dataSize) {
+// Receive exactly length bytes, however the proxy's writes were split up
+OSErr ReceiveTCPData(StreamPtr stream, Ptr buffer, long length) {
     OSErr err;
     TCPiopb pb;
     long totalReceived = 0;
-    long bufferSize = kMaxBMPSize;
-    Ptr buffer;
-    long finalTicks;
-    unsigned short timeout;
-    
-    // Allocate buffer for BMP data
-    buffer = NewPtr(bufferSize);
-    if (buffer == NULL) {
-        LogError("Memory allocation failed");
-        return memFullErr;
-    }
+    long chunk;
     
-    LogInfo("Buffer allocated, starting receive...");
-    
-    // Check connection status first
-    {
-        TCPiopb statusPB;
-        statusPB.ioCompletion = NULL;
-        statusPB.ioCRefNum = gTCPDriverRefNum;
-        statusPB.csCode = TCPStatus;
-        statusPB.tcpStream = stream;
+    while (totalReceived < length) {
+        chunk = length - totalReceived;
+        if (chunk > kRcvBufferSize) {
+            chunk = kRcvBufferSize;
+        }
+        
+        pb.ioCompletion = NULL;
+        pb.ioCRefNum = gTCPDriverRefNum;
+        pb.csCode = TCPRcv;
+        pb.tcpStream = stream;
+        pb.csParam.receive.commandTimeoutValue = 60;
+        pb.csParam.receive.rcvBuff = buffer + totalReceived;
+        pb.csParam.receive.rcvBuffLen = chunk;
+        pb.csParam.receive.userDataPtr = NULL;
         
-        err = DoTCPControl(&statusPB);
+        err = DoTCPControl(&pb);
         if (err != noErr) {
-            LogError("Connection status check failed");
-            DisposePtr(buffer);
             return err;
         }
-        
-        LogInfo("Connection status OK");
+        if (!gGotFirstData) {
+            gFirstDataMark = TimingStart();
+            gGotFirstData = true;
+        }
+        totalReceived += pb.csParam.receive.rcvBuffLen;
     }
     
-    // Receive data in chunks
-    timeout = 60;  // 60 second timeout for data
+    return noErr;
+}
+
+// Read one record from a subscribed connection. *data is NULL for a
+// heartbeat. An image lands in the arena's receive slot; anything else
+// in a small buffer of our own. Either way it is only good until the
+// next record.
+OSErr ReceivePushRecord(StreamPtr stream, long *type, Ptr *data, long *dataSize) {
+    static long smallRecord[8];
+    OSErr err;
+    PushRecordHeader header;
+    Ptr buffer;
+    long bufferSize;
     
-    // Try a simple single receive first
-    // Clear the entire parameter block first
-    {
-        char *pbPtr = (char *)&pb;
-        int i;
-        for (i = 0; i < sizeof(TCPiopb); i++) {
-            pbPtr[i] = 0;
-        }
+    *data = NULL;
+    *dataSize = 0;
+    
+    err = ReceiveTCPData(stream, (Ptr)&header, sizeof(header));
+    if (err != noErr) {
+        return err;
     }
     
-    pb.ioCompletion = NULL;
-    pb.ioCRefNum = gTCPDriverRefNum;
-    pb.csCode = TCPRcv;  // Use standard receive
-    pb.tcpStream = stream;
-    pb.csParam.receive.commandTimeoutValue = 30;  // Use a reasonable timeout
-    pb.csParam.receive.rcvBuff = buffer;
-    pb.csParam.receive.rcvBuffLen = 512;  // Even smaller buffer
-    pb.csParam.receive.userDataPtr = NULL;
-    
-    // Check if there's data available first
-    {
-        TCPiopb statusPB;
-        // Clear status parameter block
-        char *statusPtr = (char *)&statusPB;
-        int i;
-        for (i = 0; i < sizeof(TCPiopb); i++) {
-            statusPtr[i] = 0;
-        }
-        
-        statusPB.ioCompletion = NULL;
-        statusPB.ioCRefNum = gTCPDriverRefNum;
-        statusPB.csCode = TCPStatus;
-        statusPB.tcpStream = stream;
+    *type = header.type;
+    if (header.length == 0) {
+        return noErr;
+    }
+    
+    if (header.type == kPushImageRecord) {
+        buffer = gArena.receive;
+        bufferSize = gArena.receiveSize;
+    } else {
+        buffer = (Ptr)smallRecord;
+        bufferSize = sizeof(smallRecord);
+    }
+    
+    if (header.length < 0 || header.length > bufferSize) {
+        LogError("Push record too large");
+        return paramErr;
+    }
+    
+    err = ReceiveTCPData(stream, buffer, header.length);
+    if (err != noErr) {
+        return err;
+    }
+    
+    *data = buffer;
+    *dataSize = header.length;
+    return noErr;
+}
+
+// CRC-32 as zlib computes it, table built on first use
+static unsigned long gCRCTable[256];
+static Boolean gCRCTableReady = false;
+
+unsigned long CRC32(Ptr data, long length) {
+    unsigned char *bytes = (unsigned char *)data;
+    unsigned long crc = 0xFFFFFFFFUL;
+    
+    if (!gCRCTableReady) {
+        unsigned long entry;
+        short i, bit;
         
-        err = DoTCPControl(&statusPB);
-        if (err == noErr) {
-            if (statusPB.csParam.status.amtUnreadData > 0) {
-                LogInfo("Data available for reading");
-            } else {
-                LogInfo("No data available yet, waiting...");
-                // Wait a moment for data to arrive
-                finalTicks = TickCount() + 180;  // 3 second wait
-                while (TickCount() < finalTicks) {
-                    // Do nothing, just wait
-                }
-                LogInfo("Waited for data");
+        for (i = 0; i < 256; i++) {
+            entry = i;
+            for (bit = 0; bit < 8; bit++) {
+                entry = (entry & 1) ? (entry >> 1) ^ 0xEDB88320UL : entry >> 1;
             }
+            gCRCTable[i] = entry;
         }
+        gCRCTableReady = true;
     }
     
-    LogInfo("Attempting first receive...");
+    while (length-- > 0) {
+        crc = gCRCTable[(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+    }
     
-    err = DoTCPControl(&pb);
+    return crc ^ 0xFFFFFFFFUL;
+}
+
+// Receive a resumable transfer into state, picking up where it left off
+// if the proxy is resuming the same frame. On an error state keeps every
+// chunk that checked out, ready for the next attempt; on success the
+// whole frame is in state->buffer.
+OSErr ReceiveResumableFrame(StreamPtr stream, ResumeState *state) {
+    OSErr err;
+    TransferHeader header;
+    long chunkLength;
+    unsigned long crc;
     
-    if (err == noErr) {
-        LogInfo("First receive succeeded!");
-        totalReceived = pb.csParam.receive.rcvBuffLen;
-    } else {
-        LogError("First receive failed");
-        if (err == -1) {
-            LogError("Driver not opened");
-        } else if (err == invalidStreamPtr) {
-            LogError("Invalid stream pointer");
-        } else if (err == connectionDoesntExist) {
-            LogError("Connection doesn't exist");
-        } else if (err == connectionClosing) {
-            LogError("Connection is closing");
-        } else if (err == connectionTerminated) {
-            LogError("Connection terminated");
-        } else if (err == commandTimeout) {
-            LogError("Command timeout");
-        } else {
-            LogError("Unknown TCP error");
-        }
-        DisposePtr(buffer);
+    err = ReceiveTCPData(stream, (Ptr)&header, sizeof(header));
+    if (err != noErr) {
         return err;
     }
     
-    // If we got here, the basic receive works, so continue with the loop
-    while (totalReceived < bufferSize) {
-        pb.ioCompletion = NULL;
-        pb.ioCRefNum = gTCPDriverRefNum;
-        pb.csCode = TCPRcv;
-        pb.tcpStream = stream;
-        pb.csParam.receive.commandTimeoutValue = timeout;
-        pb.csParam.receive.rcvBuff = buffer + totalReceived;
-        pb.csParam.receive.rcvBuffLen = bufferSize - totalReceived;
-        pb.csParam.receive.userDataPtr = NULL;
-        
-        err = DoTCPControl(&pb);
+    if (header.magic != kTransferMagic || header.chunkSize <= 0 ||
+        header.length <= 0 || header.length > gArena.receiveSize ||
+        header.offset < 0 || header.offset > header.length) {
+        LogError("Invalid transfer header");
+        return paramErr;
+    }
+    
+    if (header.offset > 0 && state->received > 0 &&
+        header.frameId == state->frameId && header.length == state->length &&
+        header.offset <= state->received) {
+        LogInfo("Resuming interrupted transfer");
+        state->received = header.offset;
+    } else if (header.offset == 0) {
+        // A new frame, into the receive slot
+        state->buffer = gArena.receive;
+        state->frameId = header.frameId;
+        state->length = header.length;
+        state->received = 0;
+    } else {
+        LogError("Proxy resumed a transfer we don't have");
+        return paramErr;
+    }
+    
+    while (state->received < state->length) {
+        chunkLength = state->length - state->received;
+        if (chunkLength > header.chunkSize) {
+            chunkLength = header.chunkSize;
+        }
         
+        err = ReceiveTCPData(stream, state->buffer + state->received, chunkLength);
         if (err == noErr) {
-            totalReceived += pb.csParam.receive.rcvBuffLen;
-            
-            LogInfo("Received some data...");
-            
-            // Check if we have received the BMP header to know the file size
-            if (totalReceived >= 14) {
-                unsigned char *headerBytes = (unsigned char *)buffer;
-                long fileSize = headerBytes[2] | (headerBytes[3] << 8) | 
-                               (headerBytes[4] << 16) | (headerBytes[5] << 24);
-                
-                LogInfo("BMP header received");
-                
-                if (fileSize > 0 && fileSize <= bufferSize && totalReceived >= fileSize) {
-                    // We have the complete file
-                    LogInfo("Complete file received!");
-                    break;
-                }
-            }
-        } else if (err == connectionClosing || err == connectionTerminated) {
-            // Connection closed by server, assume we have all data
-            LogInfo("Connection closed by server");
-            break;
-        } else {
-            // Error receiving data
-            LogError("Error receiving data");
-            // Show error code for debugging
-            if (err == -1) {
-                LogError("Driver not opened");
-            } else if (err == invalidStreamPtr) {
-                LogError("Invalid stream pointer");
-            } else if (err == connectionDoesntExist) {
-                LogError("Connection doesn't exist");
-            } else if (err == connectionClosing) {
-                LogError("Connection is closing");
-            } else if (err == connectionTerminated) {
-                LogError("Connection terminated");
-            } else if (err == commandTimeout) {
-                LogError("Command timeout");
-            } else {
-                LogError("TCP receive error");
-            }
-            DisposePtr(buffer);
+            err = ReceiveTCPData(stream, (Ptr)&crc, sizeof(crc));
+        }
+        if (err != noErr) {
             return err;
         }
+        
+        if (crc != CRC32(state->buffer + state->received, chunkLength)) {
+            LogWarn("Chunk checksum mismatch");
+            return ioErr;
+        }
+        state->received += chunkLength;
     }
     
-    *bmpData = buffer;
-    *dataSize = totalReceived;
+    return noErr;
+}
+
+// How much has arrived without blocking. Returns connectionClosing once
+// the proxy has gone away and everything it sent has been read.
+OSErr GetUnreadData(StreamPtr stream, unsigned short *amount) {
+    OSErr err;
+    TCPiopb pb;
     
-    if (totalReceived > 0) {
-        LogInfo("Data received successfully!");
-    } else {
-        LogError("No data received");
+    pb.ioCompletion = NULL;
+    pb.ioCRefNum = gTCPDriverRefNum;
+    pb.csCode = TCPStatus;
+    pb.tcpStream = stream;
+    
+    err = DoTCPControl(&pb);
+    if (err != noErr) {
+        return err;
+    }
+    
+    *amount = pb.csParam.status.amtUnreadData;
+    if (*amount == 0 && pb.csParam.status.connectionState != kTCPStateEstablished) {
+        return connectionClosing;
     }
     
     return noErr;
 }
 
+// Close a connection and release its stream
+void CloseTCPStream(StreamPtr stream) {
+    TCPiopb pb;
+    
+    pb.ioCompletion = NULL;
+    pb.ioCRefNum = gTCPDriverRefNum;
+    pb.csCode = TCPClose;
+    pb.tcpStream = stream;
+    pb.csParam.close.validityFlags = 0;
+    pb.csParam.close.ulpTimeoutValue = 30;
+    pb.csParam.close.ulpTimeoutAction = 1;
+    
+    DoTCPControl(&pb);
+    
+    ReleaseTCPStream(stream);
+}
+
 void CleanupTCP(void) {
     TCPiopb pb;
     
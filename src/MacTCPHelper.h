@@ -52,18 +52,37 @@ typedef long SInt32;
 #include <MacTCP.h>
 #include <OSUtils.h>
 #include <Memory.h>
+#include "Timing.h"
 
 // External references to TCP globals (defined in mactcphelper.c)
 extern StreamPtr tcpStream;
 extern Boolean gHaveMacTCP;
 extern short gTCPDriverRefNum;
+extern TimingMark gFirstDataMark;
+extern Boolean gGotFirstData;
+
+// Progress of a resumable transfer, kept across reconnects. buffer (the
+// arena's receive slot) holds the first received bytes of frameId, every
+// one of them checksummed.
+typedef struct {
+    long frameId;
+    long length;
+    long received;
+    Ptr buffer;
+} ResumeState;
 
 /* Function Prototypes */
 OSErr DoTCPControl(TCPiopb *pb);
 OSErr InitMacTCP(void);
 OSErr ParseIPAddress(const char *ipString, ip_addr *ipAddr);
-OSErr ConnectToServer(ip_addr serverIP, unsigned short serverPort, StreamPtr *stream);
-OSErr ReceiveBMPData(StreamPtr stream, Ptr *bmpData, long *dataSize);
+OSErr ConnectToServer(ip_addr serverIP, unsigned short serverPort, StreamPtr *stream, const char *hello);
+OSErr SendTCPData(StreamPtr stream, Ptr data, unsigned short length);
+OSErr ReceiveTCPData(StreamPtr stream, Ptr buffer, long length);
+OSErr ReceivePushRecord(StreamPtr stream, long *type, Ptr *data, long *dataSize);
+OSErr ReceiveResumableFrame(StreamPtr stream, ResumeState *state);
+unsigned long CRC32(Ptr data, long length);
+OSErr GetUnreadData(StreamPtr stream, unsigned short *amount);
+void CloseTCPStream(StreamPtr stream);
 void CleanupTCP(void);
 
 #endif /* __MACTCPHELPER_H__ */
\ No newline at end of file
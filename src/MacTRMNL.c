@@ -24,21 +24,44 @@
 #include <OSUtils.h>
 #include <Gestalt.h>
 #include <Sound.h>
+#include <LowMem.h>
 #include <string.h>
+#include <stdio.h>
 
 // Local includes
 #include "Logging.h"
 #include "MacTCPHelper.h"
+#include "MacUDPHelper.h"
 #include "Preferences.h"
+#include "FrameFormat.h"
+#include "Timing.h"
+#include "Arena.h"
+#include "Blit.h"
+#include "Scale.h"
 
 // Constants
-#define kMaxBMPSize			    65536L
+#define kHelloMaxLength         192
 
 #define kSleep				    60
 
+// Subscribed connections: the proxy heartbeats every 30 seconds, so
+// after three missed ones (plus slack) assume it has gone
+#define kPushTimeoutTicks       6000L
+#define kReconnectTicks         1800L  /* 30 seconds between reconnect attempts */
+// Broadcast frames: ask for missing chunks after a second of silence,
+// and fall back to fetching over TCP if a few NAKs don't fill the gaps
+#define kNakTicks               60L
+#define kMaxNaks                5
+// One-shot fetches: reconnect and resume this many times in a row, as
+// long as each attempt gets some more of the frame through
+#define kMaxResumes             5
+
 #define kOn				        1
 #define kOff				    0
 
+#define kStatsWidth             210  /* Timing overlay, toggled with T */
+#define kStatsHeight            50
+
 #define kStartWindowWidth	    300
 #define kStartWindowHeight      200
 #define kStartButtonWidth       80
@@ -68,6 +91,7 @@
 #define kSaveSettingsItem       7   /* Save Settings checkbox */
 #define kExitButtonID           8   /* Exit button */
 #define kSaveButtonID           9   /* Save button */
+#define kKioskModeItem          10  /* Kiosk Mode checkbox */
 
 /* Strucs and Enums */
 typedef struct {
@@ -77,6 +101,9 @@ typedef struct {
     Boolean autoRefresh;
     Boolean enableLogFile;
     Boolean saveSettings;
+    short logLevel;
+    short logMaxKB;
+    Boolean kioskMode;
 } AppSettings;
 
 /* Globals */
@@ -90,16 +117,35 @@ Boolean         gReturnToSettings = false;  /* Flag to return to settings dialog
 Boolean         gRefreshImage = false;      /* Flag to refresh the image */
 EventRecord	    gTheEvent;
 AppSettings     gSavedSettings;
-Ptr             gBmpData = NULL;
-long            gDataSize = 0;
+Ptr             gFrontFrame = NULL;         /* QDBM frame on screen, when gHaveFrame */
+Ptr             gBackFrame = NULL;          /* Where the next image is decoded */
+Boolean         gHaveFrame = false;
+Boolean         gFrameUnsaved = false;      /* Front frame is new, not yet saved for the next launch */
 StreamPtr       gTcpStream = NULL;          /* Global TCP stream for refresh */
 ip_addr         gServerIP;
+long            gLastHeard = 0;             /* TickCount of last record from the proxy */
+StreamPtr       gUdpStream = NULL;          /* Listens for broadcast frames */
+UDPFrame        gUDPFrame;                  /* Broadcast frame being reassembled */
+ResumeState     gResume;                    /* Partial one-shot frame, kept across reconnects */
+TimingSample    gTimings;                   /* Refresh being measured */
+Boolean         gTimeNextDraw = false;      /* Next draw is of a newly received image */
+Boolean         gShowStats = false;         /* Timing overlay is up */
+TimingMark      gLaunchMark;                /* For the time to the first image */
+Boolean         gAwaitingFirstImage = true;
+short           gSavedMBarHeight = 0;       /* Non-zero while the kiosk hides the menu bar */
+RgnHandle       gMBarRgn = NULL;
 
 // Logging globals
 short gLogFileRefNum = 0;
 
 /* Function Prototypes */
-void Draw1BitBMPFromData(WindowPtr win, Ptr bmpData, long dataSize, Boolean centerImage);
+void DrawFrame(WindowPtr win, Ptr frameData, Boolean centerImage);
+OSErr CheckQDFrame(Ptr frameData, long dataSize);
+OSErr DecodeQDFrame(Ptr frameData, long dataSize, Ptr frame);
+OSErr DecodeBMP(Ptr bmpData, long dataSize, Ptr frame);
+OSErr DecodeImage(Ptr data, long dataSize, Ptr frame);
+Boolean PresentImage(Ptr data, long dataSize);
+void CalcImageRect(short width, short height, Boolean centerImage, Rect *destRect);
 void InitializeToolbox(void);
 void SetUpMenus(void);
 void DrawCenteredText(Str255 text, short y);
@@ -118,112 +164,452 @@ void SettingsDialogInit(void);
 Boolean HandleSettingsDialog(void);  /* Returns true to connect, false to quit */
 void HandleEvent(void);
 void RefreshImage(void);  /* Download and display new image */
+void BuildHello(char *hello);
+OSErr ReceiveImage(Ptr *data, long *dataSize);
+OSErr ReceiveResumable(Ptr *data, long *dataSize);
+OSErr ConnectTimed(const char *hello);
+void RecordDrawTiming(long blitTime);
+void GetStatsRect(WindowPtr win, Rect *statsRect);
+void DrawStats(WindowPtr win);
+void ToggleStats(void);
+void EnterKiosk(void);
+void LeaveKiosk(void);
+void ApplyLogSettings(void);
+OSErr SendHeartbeat(void);
+Boolean ShowNewImage(Ptr data, long dataSize);
+void ShowLastFrame(void);
+void KeepFrame(Ptr frame, long size);
+void CheckForPush(void);
+void CheckForBroadcast(void);
 
 /* External functions from MacTCPHelper */
 extern OSErr DoTCPControl(TCPiopb *pb);
 extern short gTCPDriverRefNum;
 
-/* Draw the 1-bit BitMap from raw data */
-void Draw1BitBMPFromData(WindowPtr win, Ptr bmpData, long dataSize, Boolean centerImage) {
-    int row, col;
-    unsigned char *pixelData;
-    int width, height, rowSize;
-    int i;
-    Rect destRect;
-    unsigned char *headerBytes;
-    unsigned char *infoBytes;
-    long pixelOffset;
-    int xOffset;
-    int yOffset;
-    Rect portRect;
-    BitMap offBitMap;
-    GrafPtr oldPort;
-    Ptr offBaseAddr;
-    int offRowBytes;
-    Rect srcRect;
-    int srcByte;
-    unsigned char *srcPtr;
-    unsigned char *destPtr;
+/* Build the hello line sent after connecting.
+ * Tells the proxy our screen size, the largest frame our receive slot
+ * can take and the encodings we can draw. We leave out mem: the frame
+ * buffers are set aside already, so what's left in the heap doesn't
+ * limit the image.
+ * With auto refresh on we subscribe, so new images are pushed to us,
+ * or broadcast if we're listening for UDP. Otherwise we ask for a
+ * resumable transfer, picking up any frame that was cut off. The
+ * timings of the last fetch go along too, for the proxy's metrics. */
+void BuildHello(char *hello) {
+    Rect screen = qd.screenBits.bounds;
+    char resume[32];
+    char telemetry[80];  /* " tel=" and six longs of up to 11 characters, with commas */
     
-    SetPort(win);
+    resume[0] = '\0';
+    telemetry[0] = '\0';
+    if (TimingSampleCount() > 0) {
+        const TimingSample *last = LastTimingSample();
+        
+        sprintf(telemetry, " tel=%ld,%ld,%ld,%ld,%ld,%ld",
+                last->connect, last->firstByte, last->receive,
+                last->decode, last->blit, last->freeHeap);
+    }
+    if (!gSavedSettings.autoRefresh && gResume.received > 0) {
+        sprintf(resume, " resume=%08lx:%ld", gResume.frameId, gResume.received);
+    }
     
-    // Check minimum size
-    if (dataSize < 54) {  // Min size for headers
-        LogError("Invalid BMP data - too small");
+    sprintf(hello, "TRMNL1 w=%d h=%d buf=%ld enc=qdbm,bmp%s%s%s%s\r\n",
+            screen.right - screen.left, screen.bottom - screen.top,
+            gArena.receiveSize, gSavedSettings.autoRefresh ? " sub=1" : " xfer=crc",
+            gSavedSettings.autoRefresh && gUdpStream != NULL ? " udp=1" : "", resume, telemetry);
+}
+
+/* Answer a heartbeat from the proxy, so it knows we're still here */
+OSErr SendHeartbeat(void) {
+    PushRecordHeader beat;
+    
+    beat.type = kPushHeartbeat;
+    beat.length = 0;
+    return SendTCPData(gTcpStream, (Ptr)&beat, sizeof(beat));
+}
+
+/* Replace the image on screen with a newly received one, on the next
+ * update. Returns false, leaving the old one up, if it can't be decoded. */
+Boolean ShowNewImage(Ptr data, long dataSize) {
+    if (!PresentImage(data, dataSize)) {
+        return false;
+    }
+    
+    SetPort(gMainWindow);
+    InvalRect(&gMainWindow->portRect);
+    return true;
+}
+
+/* Draw the image we last showed, saved by a previous run, while the
+ * first fetch is under way */
+void ShowLastFrame(void) {
+    long size;
+    QDFrameHeader *header = (QDFrameHeader *)gBackFrame;
+    Rect screen = qd.screenBits.bounds;
+    Ptr swap;
+    
+    // Straight into the back frame: the receive slot may hold a partial
+    // transfer we're about to resume. It was fitted to the screen when it
+    // was saved, so it only needs checking - unless the screen has
+    // changed since, in which case wait for a fresh one.
+    if (gHaveFrame || LoadLastFrame(gBackFrame, gArena.frameSize, &size) != noErr ||
+        CheckQDFrame(gBackFrame, size) != noErr ||
+        header->bounds.right - header->bounds.left > screen.right - screen.left ||
+        header->bounds.bottom - header->bounds.top > screen.bottom - screen.top) {
         return;
     }
     
-    headerBytes = (unsigned char *)bmpData;
+    swap = gFrontFrame;
+    gFrontFrame = gBackFrame;
+    gBackFrame = swap;
+    gHaveFrame = true;
+    LogDebug("Showing the last frame while we fetch...");
+    DrawFrame(gMainWindow, gFrontFrame, true);
+}
+
+/* Save a newly shown image for the next launch to start with */
+void KeepFrame(Ptr frame, long size) {
+    if (SaveLastFrame(frame, size) != noErr) {
+        LogWarn("Couldn't save the last frame");
+    }
+}
+
+/* Fill the screen with the display window, hiding the menu bar. Its
+ * keys still work, so settings are a Cmd-key away. */
+void EnterKiosk(void) {
+    Rect screen = qd.screenBits.bounds;
+    Rect mBarRect;
     
-    // Check signature
-    if (headerBytes[0] != 0x42 || headerBytes[1] != 0x4D) { 
-        LogError("Not a valid BMP file - invalid signature");
-        return; 
+    if (gSavedMBarHeight == 0) {
+        // Give the menu bar's strip to the desktop so our window can cover it
+        gSavedMBarHeight = LMGetMBarHeight();
+        mBarRect = screen;
+        mBarRect.bottom = mBarRect.top + gSavedMBarHeight;
+        gMBarRgn = NewRgn();
+        RectRgn(gMBarRgn, &mBarRect);
+        UnionRgn(GetGrayRgn(), gMBarRgn, GetGrayRgn());
+        LMSetMBarHeight(0);
     }
     
-    infoBytes = (unsigned char *)bmpData + 14;
+    MoveWindow(gMainWindow, screen.left, screen.top, true);
+    SizeWindow(gMainWindow, screen.right - screen.left, screen.bottom - screen.top, true);
+}
+
+/* Bring back the menu bar, and the display window's usual size next time
+ * it is opened */
+void LeaveKiosk(void) {
+    if (gSavedMBarHeight == 0) {
+        return;
+    }
+    LMSetMBarHeight(gSavedMBarHeight);
+    DiffRgn(GetGrayRgn(), gMBarRgn, GetGrayRgn());
+    DisposeRgn(gMBarRgn);
+    gMBarRgn = NULL;
+    gSavedMBarHeight = 0;
+    DrawMenuBar();
     
-    if (infoBytes[14] != 1) { 
-        LogError("Not a 1-bit BMP file");
-        return; 
+    if (gMainWindow != NULL) {
+        DisposeWindow(gMainWindow);
+        gMainWindow = NULL;
     }
+}
+
+/* Receive a resumable one-shot frame, reconnecting to fetch the rest
+ * whenever the link drops or a chunk fails its checksum */
+OSErr ReceiveResumable(Ptr *data, long *dataSize) {
+    OSErr err;
+    short resumes = 0;
+    long received;
+    char hello[kHelloMaxLength];
     
-    // Read dimensions
-    width = infoBytes[4] | (infoBytes[5] << 8) | (infoBytes[6] << 16) | (infoBytes[7] << 24);
-    height = infoBytes[8] | (infoBytes[9] << 8) | (infoBytes[10] << 16) | (infoBytes[11] << 24);
-    rowSize = ((width + 31) / 32) * 4;
+    err = ReceiveResumableFrame(gTcpStream, &gResume);
+    while (err != noErr && gResume.received > 0 &&
+           resumes < kMaxResumes) {
+        received = gResume.received;
+        LogWarn("Transfer interrupted, reconnecting to resume...");
+        CloseTCPStream(gTcpStream);
+        gTcpStream = NULL;
+        
+        BuildHello(hello);
+        err = ConnectToServer(gServerIP, gSavedSettings.port, &gTcpStream, hello);
+        if (err == noErr) {
+            err = ReceiveResumableFrame(gTcpStream, &gResume);
+        }
+        // Give up once an attempt stops getting us anywhere
+        resumes = gResume.received > received ? 0 : resumes + 1;
+    }
     
-    // Get pixel data offset
-    pixelOffset = headerBytes[10] | (headerBytes[11] << 8) | (headerBytes[12] << 16) | (headerBytes[13] << 24);
+    if (err == noErr) {
+        // The frame is the caller's to take; the next one starts afresh
+        *data = gResume.buffer;
+        *dataSize = gResume.length;
+        gResume.buffer = NULL;
+        gResume.received = 0;
+    }
+    return err;
+}
+
+/* Open or close the log file to match the settings, at their level and
+ * size limit */
+void ApplyLogSettings(void) {
+    gLogLevel = gSavedSettings.logLevel;
+    gLogMaxSize = gSavedSettings.logMaxKB > 0 ? gSavedSettings.logMaxKB * 1024L : 0;
+    if (gSavedSettings.enableLogFile && gLogFileRefNum == 0) {
+        InitLogging();
+    } else if (!gSavedSettings.enableLogFile && gLogFileRefNum != 0) {
+        CloseLog();
+    }
+}
+
+/* Connect to the proxy, timing it for the next hello */
+OSErr ConnectTimed(const char *hello) {
+    OSErr err;
+    TimingMark start = TimingStart();
     
-    if (pixelOffset + (rowSize * height) > dataSize) {
-        LogError("Incomplete BMP data");
+    err = ConnectToServer(gServerIP, gSavedSettings.port, &gTcpStream, hello);
+    gTimings.connect = TimingElapsed(start);
+    return err;
+}
+
+/* Note how long drawing took. The first draw of a newly received image
+ * completes its refresh, which is logged, shown on the overlay and
+ * reported in the next hello. */
+void RecordDrawTiming(long blitTime) {
+    if (!gTimeNextDraw) {
         return;
     }
+    gTimings.blit = blitTime;
+    gTimings.freeHeap = FreeMem();
+    RecordTimingSample(&gTimings);
+    gTimeNextDraw = false;
     
-    pixelData = (unsigned char *)bmpData + pixelOffset;
+    if (gAwaitingFirstImage) {
+        char summary[64];
+        
+        sprintf(summary, "First image %ld ms after launch", TimingElapsed(gLaunchMark));
+        LogSummary(summary);
+        gAwaitingFirstImage = false;
+    }
+    
+    if (gShowStats) {
+        DrawStats(gMainWindow);
+    }
+}
+
+/* The overlay sits in the bottom-left corner of the window */
+void GetStatsRect(WindowPtr win, Rect *statsRect) {
+    Rect bounds = win->portRect;
+    
+    SetRect(statsRect, bounds.left, bounds.bottom - kStatsHeight,
+            bounds.left + kStatsWidth, bounds.bottom);
+}
+
+/* Draw the last and average refresh timings over the corner of the
+ * image. Only the overlay's own rect is touched. */
+void DrawStats(WindowPtr win) {
+    GrafPtr oldPort;
+    Rect statsRect;
+    TimingSample average;
+    const TimingSample *last = LastTimingSample();
+    char line[80];
+    short oldFont, oldSize;
     
-    // Create offscreen bitmap
     GetPort(&oldPort);
+    SetPort(win);
+    oldFont = win->txFont;
+    oldSize = win->txSize;
+    TextFont(monaco);
+    TextSize(9);
+    
+    GetStatsRect(win, &statsRect);
+    EraseRect(&statsRect);
+    FrameRect(&statsRect);
     
-    // Calculate row bytes for Mac bitmap (must be even)
-    offRowBytes = ((width + 15) / 16) * 2;
+    if (last == NULL) {
+        MoveTo(statsRect.left + 4, statsRect.top + 12);
+        DrawText("No refresh timed yet", 0, 20);
+    } else {
+        AverageTimingSample(&average);
+        
+        sprintf(line, "     conn  1st  recv  dec blit ms");
+        MoveTo(statsRect.left + 4, statsRect.top + 12);
+        DrawText(line, 0, strlen(line));
+        sprintf(line, "last %4ld %4ld %5ld %4ld %4ld",
+                last->connect, last->firstByte, last->receive, last->decode, last->blit);
+        MoveTo(statsRect.left + 4, statsRect.top + 23);
+        DrawText(line, 0, strlen(line));
+        sprintf(line, "avg%-2d%4ld %4ld %5ld %4ld %4ld", TimingSampleCount(),
+                average.connect, average.firstByte, average.receive, average.decode, average.blit);
+        MoveTo(statsRect.left + 4, statsRect.top + 34);
+        DrawText(line, 0, strlen(line));
+        sprintf(line, "%ld bytes, %ldK free", last->bytes, last->freeHeap / 1024);
+        MoveTo(statsRect.left + 4, statsRect.top + 45);
+        DrawText(line, 0, strlen(line));
+    }
     
-    // Allocate memory for offscreen bitmap
-    offBaseAddr = NewPtr(offRowBytes * height);
-    if (offBaseAddr == NULL) {
+    TextFont(oldFont);
+    TextSize(oldSize);
+    SetPort(oldPort);
+}
+
+/* Show or hide the overlay. Hiding only invalidates its rect, so the
+ * update redraws just the corner of the image underneath. */
+void ToggleStats(void) {
+    GrafPtr oldPort;
+    Rect statsRect;
+    
+    if (gMainWindow == NULL) {
         return;
     }
+    gShowStats = !gShowStats;
+    if (gShowStats) {
+        DrawStats(gMainWindow);
+    } else {
+        GetPort(&oldPort);
+        SetPort(gMainWindow);
+        GetStatsRect(gMainWindow, &statsRect);
+        InvalRect(&statsRect);
+        SetPort(oldPort);
+    }
+}
+
+/* Receive the image after connecting. A subscribed connection starts
+ * with push records rather than a bare frame. */
+OSErr ReceiveImage(Ptr *data, long *dataSize) {
+    OSErr err;
+    long type;
+    TimingMark start = TimingStart();
     
-    // Clear the offscreen bitmap to white
-    for (i = 0; i < offRowBytes * height; i++) {
-        offBaseAddr[i] = 0xFF;
+    // The frame lands in the receive slot, so any broadcast we were
+    // putting together there is lost; stop its chunks landing on top
+    AbandonUDPFrame(&gUDPFrame);
+    gGotFirstData = false;
+    if (!gSavedSettings.autoRefresh) {
+        err = ReceiveResumable(data, dataSize);
+    } else {
+        do {
+            err = ReceivePushRecord(gTcpStream, &type, data, dataSize);
+            if (err == noErr && type == kPushHeartbeat) {
+                err = SendHeartbeat();
+            }
+        } while (err == noErr && type != kPushImageRecord);
+        
+        gLastHeard = TickCount();
     }
     
-    // Set up bitmap structure
-    offBitMap.baseAddr = offBaseAddr;
-    offBitMap.rowBytes = offRowBytes;
-    offBitMap.bounds.top = 0;
-    offBitMap.bounds.left = 0;
-    offBitMap.bounds.bottom = height;
-    offBitMap.bounds.right = width;
+    gTimings.firstByte = gGotFirstData ? TimingBetween(start, gFirstDataMark) : 0;
+    gTimings.receive = TimingElapsed(start);
+    gTimeNextDraw = (err == noErr);
+    return err;
+}
+
+/* On idle, pick up anything the proxy has pushed, and reconnect if it
+ * has closed the connection or gone quiet */
+void CheckForPush(void) {
+    OSErr err;
+    unsigned short unread;
+    long type;
+    Ptr recordData;
+    long recordSize;
     
-    // Convert BMP data to Mac bitmap format
-    for (row = 0; row < height; row++) {
-        srcPtr = pixelData + (height - 1 - row) * rowSize;
-        destPtr = (unsigned char *)offBaseAddr + row * offRowBytes;
-        
-        // Process bytes
-        for (col = 0; col < width; col += 8) {
-            srcByte = col / 8;
-            if (srcByte < rowSize) {
-                // Invert bits since BMP and Mac have opposite conventions
-                destPtr[col / 8] = ~srcPtr[srcByte];
+    if (!gSavedSettings.autoRefresh) {
+        // A kiosk keeps trying until it has shown its first image
+        if (gSavedSettings.kioskMode && gAwaitingFirstImage &&
+            TickCount() - gLastHeard > kReconnectTicks) {
+            gRefreshImage = true;
+        }
+        return;
+    }
+    
+    if (gTcpStream == NULL) {
+        // Last reconnect failed; RefreshImage resets gLastHeard on each try
+        if (TickCount() - gLastHeard > kReconnectTicks) {
+            gRefreshImage = true;
+        }
+        return;
+    }
+    
+    err = GetUnreadData(gTcpStream, &unread);
+    if (err != noErr) {
+        LogWarn("Proxy closed the connection, reconnecting...");
+        gRefreshImage = true;
+        return;
+    }
+    
+    if (unread == 0) {
+        if (TickCount() - gLastHeard > kPushTimeoutTicks) {
+            LogWarn("No heartbeat from proxy, reconnecting...");
+            gRefreshImage = true;
+        }
+        return;
+    }
+    
+    err = ReceivePushRecord(gTcpStream, &type, &recordData, &recordSize);
+    if (err != noErr) {
+        LogError("Failed to receive push record");
+        gRefreshImage = true;
+        return;
+    }
+    gLastHeard = TickCount();
+    
+    switch (type) {
+        case kPushImageRecord:
+            // It landed on any broadcast frame we were putting together
+            AbandonUDPFrame(&gUDPFrame);
+            if (ShowNewImage(recordData, recordSize)) {
+                LogInfo("Pushed image received");
             }
+            break;
+        case kPushHeartbeat:
+            SendHeartbeat();
+            break;
+        case kPushUDPFrame:
+            if (gUdpStream != NULL && recordSize == sizeof(UDPFrameAnnounce) &&
+                BeginUDPFrame(&gUDPFrame, (UDPFrameAnnounce *)recordData) == noErr) {
+                LogInfo("Broadcast frame announced");
+            } else {
+                gRefreshImage = true;  // Can't take it by UDP, fetch it over TCP
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/* On idle, take any broadcast chunks that have arrived. Missing chunks
+ * are NAKed once the broadcast goes quiet. */
+void CheckForBroadcast(void) {
+    if (gUdpStream == NULL) {
+        return;
+    }
+    
+    if (PollUDPFrame(gUdpStream, &gUDPFrame)) {
+        if (ShowNewImage(gUDPFrame.data, gUDPFrame.length)) {
+            LogInfo("Broadcast image received");
         }
+        gUDPFrame.data = NULL;
+        return;
+    }
+    
+    if (gUDPFrame.data == NULL || TickCount() - gUDPFrame.lastChunkTicks < kNakTicks) {
+        return;
     }
     
-    // Calculate destination rectangle
+    if (gUDPFrame.naksSent >= kMaxNaks) {
+        LogError("Broadcast incomplete, fetching over TCP");
+        AbandonUDPFrame(&gUDPFrame);
+        gRefreshImage = true;
+    } else if (SendUDPNak(gUdpStream, gServerIP, &gUDPFrame) != noErr) {
+        LogError("Failed to send NAK");
+    }
+}
+
+/* Where an image of this size goes on screen */
+void CalcImageRect(short width, short height, Boolean centerImage, Rect *destRect) {
+    Rect portRect;
+    short xOffset;
+    short yOffset;
+    
     portRect = qd.screenBits.bounds;
     if (centerImage) {
         xOffset = (portRect.right - width) / 2;
@@ -233,48 +619,221 @@ void Draw1BitBMPFromData(WindowPtr win, Ptr bmpData, long dataSize, Boolean cent
         yOffset = 10;
     }
     
-    destRect.top = yOffset;
-    destRect.left = xOffset;
-    destRect.bottom = yOffset + height;
-    destRect.right = xOffset + width;
+    destRect->top = yOffset;
+    destRect->left = xOffset;
+    destRect->bottom = yOffset + height;
+    destRect->right = xOffset + width;
+}
+
+/* Draw a QDBM frame - the data is already a QuickDraw BitMap, so point
+ * baseAddr at it and CopyBits with no per-pixel work. The frame must
+ * have been through DecodeImage. */
+void DrawFrame(WindowPtr win, Ptr frameData, Boolean centerImage) {
+    QDFrameHeader *header = (QDFrameHeader *)frameData;
+    BitMap frameBitMap;
+    Rect destRect;
+    GrafPtr oldPort;
+    short width;
+    short height;
+    TimingMark start;
+    
+    width = header->bounds.right - header->bounds.left;
+    height = header->bounds.bottom - header->bounds.top;
     
-    srcRect = offBitMap.bounds;
+    frameBitMap.baseAddr = frameData + sizeof(QDFrameHeader);
+    frameBitMap.rowBytes = header->rowBytes;
+    SetRect(&frameBitMap.bounds, 0, 0, width, height);
     
-    // Copy the bitmap to screen
-    SetPort(win);
-    CopyBits(&offBitMap, &win->portBits, &srcRect, &destRect, srcCopy, NULL);
+    CalcImageRect(width, height, centerImage, &destRect);
     
-    // Clean up
-    DisposePtr(offBaseAddr);
+    GetPort(&oldPort);
+    SetPort(win);
+    start = TimingStart();
+    CopyBits(&frameBitMap, &win->portBits, &frameBitMap.bounds, &destRect, srcCopy, NULL);
+    RecordDrawTiming(TimingElapsed(start));
     SetPort(oldPort);
+    
+    // However it arrived - fetched, pushed or broadcast - once it's up
+    if (gFrameUnsaved) {
+        gFrameUnsaved = false;
+        KeepFrame(frameData, sizeof(QDFrameHeader) + header->dataLength);
+    }
+}
+
+/* Check that a QDBM frame is one we can draw, and all there */
+OSErr CheckQDFrame(Ptr frameData, long dataSize) {
+    QDFrameHeader *header = (QDFrameHeader *)frameData;
+    short width;
+    short height;
+    
+    width = header->bounds.right - header->bounds.left;
+    height = header->bounds.bottom - header->bounds.top;
+    
+    if (dataSize < sizeof(QDFrameHeader) || header->magic != kQDFrameMagic) {
+        LogError("Not a QDBM frame");
+        return paramErr;
+    }
+    
+    if (header->version != kQDFrameVersion) {
+        LogError("Unsupported QDBM version");
+        return paramErr;
+    }
+    
+    if (width <= 0 || height <= 0 || (header->rowBytes & 1) || header->rowBytes * 8L < width) {
+        LogError("Invalid QDBM bounds");
+        return paramErr;
+    }
+    
+    if (header->dataLength < (long)header->rowBytes * height ||
+        sizeof(QDFrameHeader) + header->dataLength > dataSize) {
+        LogError("Incomplete QDBM data");
+        return paramErr;
+    }
+    
+    return noErr;
+}
+
+/* Check a QDBM frame and copy it into frame, fitted to the screen */
+OSErr DecodeQDFrame(Ptr frameData, long dataSize, Ptr frame) {
+    QDFrameHeader *header = (QDFrameHeader *)frameData;
+    OSErr err;
+    
+    err = CheckQDFrame(frameData, dataSize);
+    if (err != noErr) {
+        return err;
+    }
+    
+    return ScaleImage((unsigned char *)frameData + sizeof(QDFrameHeader), header->rowBytes, false,
+                      header->bounds.right - header->bounds.left,
+                      header->bounds.bottom - header->bounds.top, frame, gArena.frameSize);
+}
+
+/* Convert a 1-bit BMP into frame, as a QDBM frame fitted to the screen */
+OSErr DecodeBMP(Ptr bmpData, long dataSize, Ptr frame) {
+    unsigned char *pixelData;
+    long width, height, rowSize;
+    unsigned char *headerBytes;
+    unsigned char *infoBytes;
+    long pixelOffset;
+    
+    // Check minimum size
+    if (dataSize < 54) {  // Min size for headers
+        LogError("Invalid BMP data - too small");
+        return paramErr;
+    }
+    
+    headerBytes = (unsigned char *)bmpData;
+    
+    // Check signature
+    if (headerBytes[0] != 0x42 || headerBytes[1] != 0x4D) { 
+        LogError("Not a valid BMP file - invalid signature");
+        return paramErr; 
+    }
+    
+    infoBytes = (unsigned char *)bmpData + 14;
+    
+    if (infoBytes[14] != 1) { 
+        LogError("Not a 1-bit BMP file");
+        return paramErr; 
+    }
+    
+    // Read dimensions
+    width = infoBytes[4] | (infoBytes[5] << 8) | ((long)infoBytes[6] << 16) | ((long)infoBytes[7] << 24);
+    height = infoBytes[8] | (infoBytes[9] << 8) | ((long)infoBytes[10] << 16) | ((long)infoBytes[11] << 24);
+    
+    // Scaling takes shorts, and a negative height is a top-down BMP,
+    // which we don't draw
+    if (width <= 0 || width > 32767 || height <= 0 || height > 32767) {
+        LogError("Invalid BMP bounds");
+        return paramErr;
+    }
+    rowSize = ((width + 31) / 32) * 4;
+    
+    // Get pixel data offset
+    pixelOffset = headerBytes[10] | (headerBytes[11] << 8) | ((long)headerBytes[12] << 16) | ((long)headerBytes[13] << 24);
+    
+    if (pixelOffset < 54 || pixelOffset + (rowSize * height) > dataSize) {
+        LogError("Incomplete BMP data");
+        return paramErr;
+    }
+    
+    pixelData = (unsigned char *)bmpData + pixelOffset;
+    
+    // BMP rows run bottom up, so start at the last one and step back,
+    // inverting bits since BMP and Mac have opposite conventions
+    return ScaleImage(pixelData + (long)(height - 1) * rowSize, -rowSize, true,
+                      width, height, frame, gArena.frameSize);
+}
+
+/* Decode a received image, BMP or QDBM, into frame */
+OSErr DecodeImage(Ptr data, long dataSize, Ptr frame) {
+    // QDBM frames need no conversion
+    if (dataSize >= sizeof(QDFrameHeader) && ((QDFrameHeader *)data)->magic == kQDFrameMagic) {
+        return DecodeQDFrame(data, dataSize, frame);
+    }
+    return DecodeBMP(data, dataSize, frame);
+}
+
+/* Decode a newly received image into the back frame, then make it the
+ * front one. The front frame is never written to, so an image that
+ * can't be decoded leaves the last one on screen. */
+Boolean PresentImage(Ptr data, long dataSize) {
+    TimingMark start = TimingStart();
+    Ptr swap;
+    
+    if (DecodeImage(data, dataSize, gBackFrame) != noErr) {
+        gTimeNextDraw = false;
+        return false;
+    }
+    gTimings.decode = TimingElapsed(start);
+    gTimings.bytes = dataSize;
+    
+    swap = gFrontFrame;
+    gFrontFrame = gBackFrame;
+    gBackFrame = swap;
+    gHaveFrame = true;
+    gFrameUnsaved = true;
+    return true;
 }
 
 
 // Main entry point
 void main(void) {
     OSErr err;
+    Ptr data;
     long dataSize;
     DialogPtr settingsDialog;
     short dialogItemHit;
     Boolean keepTrying = true;
+    Boolean kiosk;
+    char hello[kHelloMaxLength];
     
-    // Initialize logging
-	InitLogging();
-	LogInfo("MacTRMNL Started");
-	
     // Initialize everything
-    LogInfo("Initializing Toolbox...");
+	InitTiming();
+	gLaunchMark = TimingStart();
 	InitializeToolbox();
-	LogInfo("Toolbox initialized");
-	
-	LogInfo("Setting up menus...");
 	SetUpMenus();
-	LogInfo("Menus set up");
 	
-    // Initialize settings (loads from preferences if available)
-    LogInfo("Initializing settings dialog...");
+    // Initialize settings (loads from preferences if available), then
+    // start logging if they ask for it
     SettingsDialogInit();
-    LogInfo("Settings dialog initialized");
+    ApplyLogSettings();
+    kiosk = gSavedSettings.kioskMode;
+    
+    // Set aside every buffer we'll need while the heap is still in one piece
+    InitBlit();
+    err = InitArena(qd.screenBits.bounds.right - qd.screenBits.bounds.left,
+                    qd.screenBits.bounds.bottom - qd.screenBits.bounds.top);
+    if (err != noErr) {
+        SysBeep(10);
+        while (!Button()) { }  // Wait for mouse click
+        CloseLog();
+        ExitToShell();
+    }
+    InitScale(qd.screenBits.bounds.right - qd.screenBits.bounds.left,
+              qd.screenBits.bounds.bottom - qd.screenBits.bounds.top);
+    gFrontFrame = gArena.frame[0];
+    gBackFrame = gArena.frame[1];
     
     // Initialize MacTCP once at startup
     err = InitMacTCP();
@@ -299,63 +858,102 @@ void main(void) {
         
         // Connection loop - keep trying until successful or user quits
         while (keepTrying && !gEndProgram) {
-        // Show the Settings Dialog
-        LogInfo("Showing settings dialog...");
-        if (!HandleSettingsDialog()) {
-            LogInfo("User cancelled from settings dialog");
-            keepTrying = false;
-            gEndProgram = true;
-            break;  // Exit the retry loop
-        }
-        LogInfo("User clicked Start, attempting connection...");
-        
-        // Initialize the main display window
-        if (gMainWindow == NULL) {
-            gMainWindow = GetNewWindow(kDisplayWindow, NULL, (WindowPtr)-1);
-        }
-        SetPort(gMainWindow);
-        ShowWindow(gMainWindow);
-
-        // Convert IP address string to ip_addr
-        LogInfo("Parsing IP address...");
-        err = ParseIPAddress(gSavedSettings.ipAddress, &gServerIP);
-        if (err != noErr) {
-            LogError("IP parsing failed. Please check the IP address.");
-            SysBeep(10);  // Alert user about parsing failure
-            HideWindow(gMainWindow);  // Hide the window
-            continue;  // Go back to settings dialog
-        }
-        LogInfo("IP parsed successfully");
-        
-        // Connect to server and receive BMP
-        LogInfo("Connecting to server...");
-        err = ConnectToServer(gServerIP, gSavedSettings.port, &gTcpStream);
-        if (err == noErr) {
-            LogInfo("Connected! Receiving data...");
-            err = ReceiveBMPData(gTcpStream, &gBmpData, &gDataSize);
-            if (err == noErr && gBmpData != NULL && gDataSize > 0) {
-                LogInfo("Data received! Drawing image...");
-                Draw1BitBMPFromData(gMainWindow, gBmpData, gDataSize, true);
-                // Keep gBmpData for redraws
-                keepTrying = false;  // Success! Exit the connection loop
+            if (kiosk) {
+                // Straight to the display with the saved settings
+                LogInfo("Kiosk mode, attempting connection...");
             } else {
-                if (err != noErr) {
-                    LogError("Receive function failed");
-                } else if (gBmpData == NULL) {
-                    LogError("No buffer returned");
-                } else {
-                    LogError("No data in buffer");
+                // Show the Settings Dialog
+                LogDebug("Showing settings dialog...");
+                if (!HandleSettingsDialog()) {
+                    LogInfo("User cancelled from settings dialog");
+                    keepTrying = false;
+                    gEndProgram = true;
+                    break;  // Exit the retry loop
                 }
-                SysBeep(10);
+                ApplyLogSettings();
+                LogInfo("User clicked Start, attempting connection...");
+            }
+            
+            // Initialize the main display window
+            if (gMainWindow == NULL) {
+                gMainWindow = GetNewWindow(kDisplayWindow, NULL, (WindowPtr)-1);
+            }
+            if (kiosk) {
+                EnterKiosk();
+            }
+            SetPort(gMainWindow);
+            ShowWindow(gMainWindow);
+            ShowLastFrame();
+
+            // Convert IP address string to ip_addr
+            LogDebug("Parsing IP address...");
+            err = ParseIPAddress(gSavedSettings.ipAddress, &gServerIP);
+            if (err != noErr) {
+                LogError("IP parsing failed. Please check the IP address.");
+                SysBeep(10);  // Alert user about parsing failure
                 HideWindow(gMainWindow);  // Hide the window
-                // Continue to retry loop
+                // Not even a kiosk can get anywhere without a valid address
+                if (kiosk) {
+                    kiosk = false;
+                    LeaveKiosk();
+                }
+                continue;  // Go back to settings dialog
+            }
+            LogDebug("IP parsed successfully");
+            
+            // Listen for broadcast frames as well, if we'll be subscribing
+            if (gSavedSettings.autoRefresh && gUdpStream == NULL) {
+                if (CreateUDPStream(kUDPPort, &gUdpStream) != noErr) {
+                    LogWarn("UDP unavailable, images will come over TCP");
+                    gUdpStream = NULL;
+                }
+            }
+            
+            // Connect to server and receive BMP
+            LogInfo("Connecting to server...");
+            BuildHello(hello);
+            err = ConnectTimed(hello);
+            if (err == noErr) {
+                LogDebug("Connected! Receiving data...");
+                data = NULL;
+                err = ReceiveImage(&data, &dataSize);
+                if (err == noErr && data != NULL && dataSize > 0 && PresentImage(data, dataSize)) {
+                    LogDebug("Data received! Drawing image...");
+                    // Replaces the last frame, if we were showing it
+                    DrawFrame(gMainWindow, gFrontFrame, true);
+                    // Keep the frame for redraws
+                    keepTrying = false;  // Success! Exit the connection loop
+                } else {
+                    if (err != noErr) {
+                        LogError("Receive function failed");
+                    } else if (data == NULL) {
+                        LogError("No buffer returned");
+                    } else if (dataSize <= 0) {
+                        LogError("No data in buffer");
+                    }
+                    if (kiosk) {
+                        // Keep showing the last frame; the event loop retries
+                        keepTrying = false;
+                        gLastHeard = TickCount();
+                    } else {
+                        SysBeep(10);
+                        HideWindow(gMainWindow);  // Hide the window
+                        // Continue to retry loop
+                    }
+                }
+            } else {
+                LogError("Connection failed! Please check server address and port.");
+                if (kiosk) {
+                    // Keep showing the last frame; the event loop retries
+                    keepTrying = false;
+                    gTcpStream = NULL;
+                    gLastHeard = TickCount();
+                } else {
+                    SysBeep(10);
+                    HideWindow(gMainWindow);  // Hide the window
+                    // Continue to retry loop
+                }
             }
-        } else {
-            LogError("Connection failed! Please check server address and port.");
-            SysBeep(10);
-            HideWindow(gMainWindow);  // Hide the window
-            // Continue to retry loop
-        }
         }  // End of connection loop
         
         // Main Event Loop - only reached after successful connection
@@ -376,17 +974,34 @@ void main(void) {
                 LogInfo("Returning to settings...");
                 gEndProgram = false;  // Reset flag to continue main loop
                 HideWindow(gMainWindow);  // Hide the display window
-                // Free the BMP data
-                if (gBmpData != NULL) {
-                    DisposePtr(gBmpData);
-                    gBmpData = NULL;
-                    gDataSize = 0;
+                // Settings come up as usual from here on
+                if (kiosk) {
+                    kiosk = false;
+                    LeaveKiosk();
+                }
+                // Stop the proxy pushing to us while we're in settings
+                if (gTcpStream != NULL) {
+                    CloseTCPStream(gTcpStream);
+                    gTcpStream = NULL;
                 }
+                AbandonUDPFrame(&gUDPFrame);
+                // Settings may point us at another proxy; start afresh
+                gResume.received = 0;
+                // Forget the frame; it is decoded afresh when we're back
+                gHaveFrame = false;
             }
         }
     }  // End of main application loop
     
     // Cleanup before exit
+    LeaveKiosk();
+    if (gTcpStream != NULL) {
+        CloseTCPStream(gTcpStream);
+    }
+    if (gUdpStream != NULL) {
+        AbandonUDPFrame(&gUDPFrame);
+        ReleaseUDPStream(gUdpStream);
+    }
     CleanupTCP();
     CloseLog();
 }
@@ -396,13 +1011,17 @@ void HandleEvent(void) {
 	char key;
 	Boolean dummy;
 
-	WaitNextEvent(everyEvent, &gTheEvent, kSleep, NULL);
+	// Don't sleep while broadcast chunks are arriving
+	WaitNextEvent(everyEvent, &gTheEvent, gUDPFrame.data != NULL ? 0 : kSleep, NULL);
 
 	switch (gTheEvent.what) {
         case updateEvt:
             BeginUpdate(gMainWindow);
-            if (gBmpData != NULL) {
-                Draw1BitBMPFromData(gMainWindow, gBmpData, gDataSize, true);
+            if (gHaveFrame) {
+                DrawFrame(gMainWindow, gFrontFrame, true);
+            }
+            if (gShowStats) {
+                DrawStats(gMainWindow);
             }
             EndUpdate(gMainWindow);
             break;
@@ -414,19 +1033,34 @@ void HandleEvent(void) {
 		case keyDown: case autoKey:
 			key = (char)(gTheEvent.message & charCodeMask);
             if (key == 27 || ((gTheEvent.modifiers & cmdKey) && (key == 'Q' || key == 'q'))) {
-                CleanupTCP();
-                if (gBmpData != NULL) {
-                    DisposePtr(gBmpData);
+                // MacTCP must not be left reading into our heap after we quit
+                if (gTcpStream != NULL) {
+                    CloseTCPStream(gTcpStream);
                 }
+                if (gUdpStream != NULL) {
+                    ReleaseUDPStream(gUdpStream);
+                }
+                CleanupTCP();
+                LeaveKiosk();
                 CloseLog();
             ExitToShell();
             } else if ((gTheEvent.modifiers & cmdKey) != 0) {
 				HandleMenuChoice(MenuKey(key));
+			} else if ((key == 'T' || key == 't') && gTheEvent.what == keyDown) {
+				ToggleStats();
+			} else if ((key == 'S' || key == 's') && gTheEvent.what == keyDown) {
+				// The only way into settings in kiosk mode, with no menu bar
+				HandleFileMenu(kFileMenuSettingsItem);
 			}
 			break;
 
 		case nullEvent:
-			//HandleCountDown();
+			CheckForPush();
+			CheckForBroadcast();
+			// Catch up on the log while idle, but not mid-broadcast
+			if (gUDPFrame.data == NULL) {
+				FlushLog(kLogFlushBudget);
+			}
 			break;
 	}
 }
@@ -638,7 +1272,7 @@ void RestoreSettings(DialogPtr settingsDialog) {
     Str255 ipPascalString;
     Str255 refreshRateString;
 
-    LogInfo("Restoring IP address...");
+    LogDebug("Restoring IP address...");
     // Restore IP Address
     itemHandle = DialogItemGet(settingsDialog, kIPAddressItem);
     if (itemHandle != NULL) {
@@ -648,7 +1282,7 @@ void RestoreSettings(DialogPtr settingsDialog) {
         SetDialogItemText(itemHandle, ipPascalString);
     }
 
-    LogInfo("Restoring port...");
+    LogDebug("Restoring port...");
     // Restore Port
     itemHandle = DialogItemGet(settingsDialog, kPortItem);
     if (itemHandle != NULL) {
@@ -656,7 +1290,7 @@ void RestoreSettings(DialogPtr settingsDialog) {
         SetDialogItemText(itemHandle, portString);
     }
 
-    LogInfo("Restoring refresh rate...");
+    LogDebug("Restoring refresh rate...");
     // Restore Refresh Rate
     itemHandle = DialogItemGet(settingsDialog, kRefreshRateItem);
     if (itemHandle != NULL) {
@@ -664,7 +1298,7 @@ void RestoreSettings(DialogPtr settingsDialog) {
         SetDialogItemText(itemHandle, refreshRateString);
     }
 
-    LogInfo("Restoring checkboxes...");
+    LogDebug("Restoring checkboxes...");
     // Restore "Auto Refresh" Option
     ControlSetValue(settingsDialog, kAutoRefreshItem, gSavedSettings.autoRefresh);
 
@@ -673,6 +1307,9 @@ void RestoreSettings(DialogPtr settingsDialog) {
 
     // Restore "Save Settings" Option
     ControlSetValue(settingsDialog, kSaveSettingsItem, gSavedSettings.saveSettings);
+
+    // Restore "Kiosk Mode" Option
+    ControlSetValue(settingsDialog, kKioskModeItem, gSavedSettings.kioskMode);
 }
 
 /* Save Settings */
@@ -707,6 +1344,9 @@ void SaveSettings(DialogPtr settingsDialog) {
 
     // Save "Save Settings" Option
     gSavedSettings.saveSettings = ControlGetValue(settingsDialog, kSaveSettingsItem);
+
+    // Save "Kiosk Mode" Option
+    gSavedSettings.kioskMode = ControlGetValue(settingsDialog, kKioskModeItem);
     
     // Save preferences to disk if requested
     if (gSavedSettings.saveSettings) {
@@ -717,6 +1357,9 @@ void SaveSettings(DialogPtr settingsDialog) {
         prefs.autoRefresh = gSavedSettings.autoRefresh;
         prefs.enableLogFile = gSavedSettings.enableLogFile;
         prefs.saveSettings = gSavedSettings.saveSettings;
+        prefs.logLevel = gSavedSettings.logLevel;
+        prefs.logMaxKB = gSavedSettings.logMaxKB;
+        prefs.kioskMode = gSavedSettings.kioskMode;
         
         SavePreferences(&prefs);
         // We don't check the error here - preferences saving is best-effort
@@ -738,6 +1381,9 @@ void SettingsDialogInit(void) {
         gSavedSettings.autoRefresh = prefs.autoRefresh;
         gSavedSettings.enableLogFile = prefs.enableLogFile;
         gSavedSettings.saveSettings = prefs.saveSettings;
+        gSavedSettings.logLevel = prefs.logLevel != 0 ? prefs.logLevel : kLogLevelInfo;
+        gSavedSettings.logMaxKB = prefs.logMaxKB != 0 ? prefs.logMaxKB : kLogDefaultMaxSize / 1024;
+        gSavedSettings.kioskMode = prefs.kioskMode;
     } else {
         // Use defaults if preferences couldn't be loaded
         strcpy(gSavedSettings.ipAddress, "10.0.1.26"); // Default IP
@@ -746,6 +1392,9 @@ void SettingsDialogInit(void) {
         gSavedSettings.autoRefresh = kOn; // Enable auto refresh by default
         gSavedSettings.enableLogFile = kOn; // Enable log file by default
         gSavedSettings.saveSettings = kOn; // Save settings by default
+        gSavedSettings.logLevel = kLogLevelInfo;
+        gSavedSettings.logMaxKB = kLogDefaultMaxSize / 1024;
+        gSavedSettings.kioskMode = kOff;
     }
 }
 
@@ -757,17 +1406,17 @@ Boolean HandleSettingsDialog(void) {
     Handle itemHandle;
     DialogPtr settingsDialog;
 
-    LogInfo("Getting new dialog...");
+    LogDebug("Getting new dialog...");
     settingsDialog = GetNewDialog(kSettingsDialogID, NULL, (WindowPtr)-1);
     if (settingsDialog == NULL) {
         LogError("Failed to get settings dialog");
         return false;  // Can't continue without dialog
     }
-    LogInfo("Got dialog, showing window...");
+    LogDebug("Got dialog, showing window...");
     ShowWindow(settingsDialog);
-    LogInfo("Window shown, restoring settings...");
+    LogDebug("Window shown, restoring settings...");
     RestoreSettings(settingsDialog);
-    LogInfo("Settings restored");
+    LogDebug("Settings restored");
 
     dialogDone = false;
 
@@ -790,8 +1439,10 @@ Boolean HandleSettingsDialog(void) {
                 // Flash the button or beep to indicate save
                 SysBeep(1);
                 break;
+            case kAutoRefreshItem:
             case kEnableLogFileItem:
             case kSaveSettingsItem:
+            case kKioskModeItem:
                 ControlFlip(settingsDialog, itemHit);
                 break;
         }
@@ -805,41 +1456,23 @@ void RefreshImage(void) {
     OSErr err;
     Ptr newBmpData = NULL;
     long newDataSize = 0;
-    TCPiopb pb;
+    char hello[kHelloMaxLength];
     
     LogInfo("Refreshing image...");
+    gLastHeard = TickCount();
     
-    // Check if we have a valid connection
-    if (gTcpStream == NULL) {
-        LogError("No active connection for refresh");
-        return;
+    // Close the existing connection, if the last reconnect didn't fail.
+    // The server sends one image per connection unless we subscribe.
+    if (gTcpStream != NULL) {
+        LogDebug("Closing existing connection...");
+        CloseTCPStream(gTcpStream);
+        gTcpStream = NULL;
     }
     
-    // Close the existing connection
-    // The server expects one image per connection
-    LogInfo("Closing existing connection...");
-    pb.ioCompletion = NULL;
-    pb.ioCRefNum = gTCPDriverRefNum;
-    pb.csCode = TCPClose;
-    pb.tcpStream = gTcpStream;
-    pb.csParam.close.validityFlags = 0;
-    pb.csParam.close.ulpTimeoutValue = 30;
-    pb.csParam.close.ulpTimeoutAction = 1;
-    
-    DoTCPControl(&pb);
-    
-    // Release the stream
-    pb.ioCompletion = NULL;
-    pb.ioCRefNum = gTCPDriverRefNum;
-    pb.csCode = TCPRelease;
-    pb.tcpStream = gTcpStream;
-    
-    DoTCPControl(&pb);
-    gTcpStream = NULL;
-    
     // Reconnect to server
-    LogInfo("Reconnecting to server...");
-    err = ConnectToServer(gServerIP, gSavedSettings.port, &gTcpStream);
+    LogDebug("Reconnecting to server...");
+    BuildHello(hello);
+    err = ConnectTimed(hello);
     if (err != noErr) {
         LogError("Refresh failed - couldn't reconnect");
         SysBeep(10);
@@ -848,23 +1481,12 @@ void RefreshImage(void) {
     }
     
     // Receive new BMP data
-    LogInfo("Downloading new image...");
-    err = ReceiveBMPData(gTcpStream, &newBmpData, &newDataSize);
-    if (err == noErr && newBmpData != NULL && newDataSize > 0) {
-        // Free old image data
-        if (gBmpData != NULL) {
-            DisposePtr(gBmpData);
-        }
-        
-        // Update with new data
-        gBmpData = newBmpData;
-        gDataSize = newDataSize;
-        
-        // Redraw the window
-        LogInfo("Drawing new image...");
-        SetPort(gMainWindow);
-        InvalRect(&gMainWindow->portRect);  // Force window update
-        
+    LogDebug("Downloading new image...");
+    err = ReceiveImage(&newBmpData, &newDataSize);
+    if (err == noErr && newBmpData != NULL && newDataSize > 0 &&
+        ShowNewImage(newBmpData, newDataSize)) {
+        // Drawn on the next update
+        LogDebug("Drawing new image...");
         LogInfo("Image refreshed successfully");
     } else {
         LogError("Failed to receive new image data");
@@ -20,6 +20,10 @@ type 'PREF' {
     boolean;            /* Enable Log File */
     boolean;            /* Save Settings */
     align word;         /* Align to word boundary */
+    integer;            /* Log Level: 1 error, 2 warn, 3 info, 4 debug, 5 trace */
+    integer;            /* Log size in KB before it is rotated, -1 for no limit */
+    boolean;            /* Kiosk Mode */
+    align word;         /* Align to word boundary */
 };
 
 /* Application signature resource */
@@ -133,6 +133,13 @@ resource 'DITL' (128) {
             "Save"
         };
         
+        /* Item 10: Kiosk Mode checkbox */
+        {180, 20, 198, 200},
+        CheckBox {
+            enabled,
+            "Kiosk Mode"
+        };
+        
         /* Static text: IP Address label */
         {20, 20, 46, 110},
         StaticText {
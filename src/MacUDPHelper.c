@@ -0,0 +1,205 @@
+/*
+ * MacUDPHelper.c
+ *
+ * MacTCP UDP helper functions for MacTRMNL
+ * Reassembles frames the proxy broadcasts as sequenced chunks, and asks
+ * the proxy to resend just the chunks that went missing
+ *
+ * Written by Erik Reynolds
+ * v20250702-1
+ */
+
+#include <OSUtils.h>
+#include <Memory.h>
+#include <Devices.h>
+#include "MacUDPHelper.h"
+#include "logging.h"
+#include "Arena.h"
+
+// One UDPRead is kept outstanding so datagrams can be picked up from
+// the event loop without blocking it
+static UDPiopb gReadPB;
+static Boolean gReadPending = false;
+
+// Helper function for MacTCP UDP control calls
+static OSErr DoUDPControl(UDPiopb *pb, Boolean async) {
+    if (gTCPDriverRefNum == 0) {
+        return -1;  // Driver not opened
+    }
+    pb->ioCRefNum = gTCPDriverRefNum;
+    pb->ioCompletion = NULL;
+
+    return PBControl((ParmBlkPtr)pb, async);
+}
+
+OSErr CreateUDPStream(udp_port port, StreamPtr *stream) {
+    OSErr err;
+    UDPiopb pb;
+
+    pb.csCode = UDPCreate;
+    pb.csParam.create.rcvBuff = gArena.udpBuffer;
+    pb.csParam.create.rcvBuffLen = kUDPBufferSize;
+    pb.csParam.create.notifyProc = NULL;
+    pb.csParam.create.localPort = port;
+    pb.csParam.create.userDataPtr = NULL;
+
+    err = DoUDPControl(&pb, false);
+    if (err != noErr) {
+        return err;
+    }
+
+    *stream = pb.udpStream;
+    gReadPending = false;
+    LogDebug("UDP stream created");
+    return noErr;
+}
+
+void ReleaseUDPStream(StreamPtr stream) {
+    UDPiopb pb;
+
+    // Releasing the stream also completes any outstanding read. Its
+    // buffer is the arena's, ready for the next stream.
+    pb.csCode = UDPRelease;
+    pb.udpStream = stream;
+
+    DoUDPControl(&pb, false);
+    gReadPending = false;
+}
+
+// Start reassembling an announced frame, dropping any unfinished one
+OSErr BeginUDPFrame(UDPFrame *frame, const UDPFrameAnnounce *announce) {
+    short i;
+
+    AbandonUDPFrame(frame);
+
+    if (announce->length <= 0 || announce->length > gArena.receiveSize ||
+        announce->chunkCount != (announce->length + kUDPChunkSize - 1) / kUDPChunkSize) {
+        LogError("Invalid broadcast announcement");
+        return paramErr;
+    }
+
+    // Reassembled in the receive slot. Anything else that lands there -
+    // a pushed image, a TCP fetch or the saved frame - abandons this one.
+    frame->data = gArena.receive;
+    frame->frameId = announce->frameId;
+    frame->length = announce->length;
+    frame->chunkCount = announce->chunkCount;
+    frame->chunksReceived = 0;
+    frame->lastChunkTicks = TickCount();
+    frame->naksSent = 0;
+    for (i = 0; i < sizeof(frame->missing); i++) {
+        frame->missing[i] = 0;
+    }
+    for (i = 0; i < frame->chunkCount; i++) {
+        frame->missing[i >> 3] |= 0x80 >> (i & 7);
+    }
+
+    return noErr;
+}
+
+void AbandonUDPFrame(UDPFrame *frame) {
+    frame->data = NULL;
+}
+
+// Copy a chunk into the frame if it belongs there and is new
+static void StoreChunk(UDPFrame *frame, Ptr datagram, unsigned short length) {
+    UDPChunkHeader *header = (UDPChunkHeader *)datagram;
+    short index;
+    long offset;
+    long chunkLength;
+
+    if (frame->data == NULL || length < sizeof(UDPChunkHeader) ||
+        header->magic != kUDPChunkMagic || header->frameId != frame->frameId ||
+        header->count != frame->chunkCount || header->length != frame->length) {
+        return;
+    }
+
+    index = header->index;
+    if (index < 0 || index >= frame->chunkCount ||
+        !(frame->missing[index >> 3] & (0x80 >> (index & 7)))) {
+        return;
+    }
+
+    offset = (long)index * kUDPChunkSize;
+    chunkLength = length - sizeof(UDPChunkHeader);
+    if (chunkLength > frame->length - offset) {
+        chunkLength = frame->length - offset;
+    }
+
+    BlockMove(datagram + sizeof(UDPChunkHeader), frame->data + offset, chunkLength);
+    frame->missing[index >> 3] &= ~(0x80 >> (index & 7));
+    frame->chunksReceived++;
+    frame->lastChunkTicks = TickCount();
+}
+
+// Take every datagram that has arrived. Returns true once the frame is
+// complete; it stays in frame->data for the caller to take over.
+Boolean PollUDPFrame(StreamPtr stream, UDPFrame *frame) {
+    UDPiopb returnPB;
+
+    while (true) {
+        if (!gReadPending) {
+            gReadPB.csCode = UDPRead;
+            gReadPB.udpStream = stream;
+            gReadPB.csParam.receive.timeOut = 30;
+            gReadPB.csParam.receive.userDataPtr = NULL;
+            if (DoUDPControl(&gReadPB, true) != noErr) {
+                break;
+            }
+            gReadPending = true;
+        }
+
+        if (gReadPB.ioResult > 0) {
+            break;  // Still waiting
+        }
+
+        gReadPending = false;
+        if (gReadPB.ioResult != noErr) {
+            // Timed out with nothing to read, or the stream went away
+            break;
+        }
+
+        StoreChunk(frame, gReadPB.csParam.receive.rcvBuff, gReadPB.csParam.receive.rcvBuffLen);
+
+        returnPB.csCode = UDPBfrReturn;
+        returnPB.udpStream = stream;
+        returnPB.csParam.receive.rcvBuff = gReadPB.csParam.receive.rcvBuff;
+        DoUDPControl(&returnPB, false);
+    }
+
+    return frame->data != NULL && frame->chunksReceived == frame->chunkCount;
+}
+
+// Ask the proxy to rebroadcast the chunks we don't have
+OSErr SendUDPNak(StreamPtr stream, ip_addr proxyIP, UDPFrame *frame) {
+    struct {
+        long magic;
+        long frameId;
+        short chunkCount;
+        unsigned char missing[kUDPMaxChunks / 8];
+    } nak;
+    wdsEntry wds[2];
+    UDPiopb pb;
+
+    nak.magic = kUDPNakMagic;
+    nak.frameId = frame->frameId;
+    nak.chunkCount = frame->chunkCount;
+    BlockMove(frame->missing, nak.missing, sizeof(nak.missing));
+
+    wds[0].length = 10 + (frame->chunkCount + 7) / 8;
+    wds[0].ptr = (Ptr)&nak;
+    wds[1].length = 0;
+    wds[1].ptr = NULL;
+
+    pb.csCode = UDPWrite;
+    pb.udpStream = stream;
+    pb.csParam.send.remoteHost = proxyIP;
+    pb.csParam.send.remotePort = kUDPPort;
+    pb.csParam.send.wdsPtr = (Ptr)wds;
+    pb.csParam.send.checkSum = true;
+    pb.csParam.send.userDataPtr = NULL;
+
+    frame->naksSent++;
+    frame->lastChunkTicks = TickCount();
+    return DoUDPControl(&pb, false);
+}
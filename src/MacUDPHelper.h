@@ -0,0 +1,44 @@
+/*
+ * MacUDPHelper.h
+ * 
+ * MacTCP UDP helper functions for MacTRMNL
+ * Reassembles frames the proxy broadcasts as sequenced chunks, and asks
+ * the proxy to resend just the chunks that went missing
+ * 
+ * Written by Erik Reynolds
+ * v20250702-1
+ */
+
+#ifndef __MACUDPHELPER_H__
+#define __MACUDPHELPER_H__
+
+#include "MacTCPHelper.h"
+#include "FrameFormat.h"
+
+// Must match the proxy's UDP_PORT, which defaults to the same port
+#define kUDPPort            1338
+#define kMaxBroadcastSize   65536L
+#define kUDPMaxChunks       (kMaxBroadcastSize / kUDPChunkSize)
+
+// A broadcast frame being reassembled, in the arena's receive slot. data
+// is NULL when there is none.
+typedef struct {
+    long frameId;
+    long length;
+    short chunkCount;
+    short chunksReceived;
+    Ptr data;
+    long lastChunkTicks;    // When a chunk last arrived, or the last NAK went out
+    short naksSent;
+    unsigned char missing[kUDPMaxChunks / 8];  // Bit set = not received yet
+} UDPFrame;
+
+/* Function Prototypes */
+OSErr CreateUDPStream(udp_port port, StreamPtr *stream);
+void ReleaseUDPStream(StreamPtr stream);
+OSErr BeginUDPFrame(UDPFrame *frame, const UDPFrameAnnounce *announce);
+void AbandonUDPFrame(UDPFrame *frame);
+Boolean PollUDPFrame(StreamPtr stream, UDPFrame *frame);
+OSErr SendUDPNak(StreamPtr stream, ip_addr proxyIP, UDPFrame *frame);
+
+#endif /* __MACUDPHELPER_H__ */
@@ -15,6 +15,8 @@
 #include <Errors.h>
 #include <string.h>
 #include "Preferences.h"
+#include "Logging.h"
+#include "FrameFormat.h"
 
 // Get the System Folder's Preferences folder
 OSErr GetPreferencesFolder(short *vRefNum, long *dirID) {
@@ -74,6 +76,8 @@ OSErr CreatePreferencesFile(short vRefNum, long dirID) {
     prefsPtr->port = 1337;
     prefsPtr->enableLogFile = true;
     prefsPtr->saveSettings = true;
+    prefsPtr->logLevel = kLogLevelInfo;
+    prefsPtr->logMaxKB = kLogDefaultMaxSize / 1024;
     
     // Add the resource
     AddResource(prefHandle, kPrefsResType, kPrefsResID, "\pMacTRMNL Preferences");
@@ -96,6 +100,7 @@ OSErr LoadPreferences(PrefsData *prefs) {
     long dirID;
     short refNum;
     Handle prefHandle;
+    long size;
     
     if (prefs == NULL) {
         return paramErr;
@@ -135,9 +140,15 @@ OSErr LoadPreferences(PrefsData *prefs) {
         return resNotFound;
     }
     
-    // Copy the data
+    // Copy the data. Prefs saved by an older version are shorter; the
+    // fields they lack are left zero.
+    size = GetHandleSize(prefHandle);
+    if (size > sizeof(PrefsData)) {
+        size = sizeof(PrefsData);
+    }
+    memset(prefs, 0, sizeof(PrefsData));
     HLock(prefHandle);
-    BlockMove(*prefHandle, prefs, sizeof(PrefsData));
+    BlockMove(*prefHandle, prefs, size);
     HUnlock(prefHandle);
     
     ReleaseResource(prefHandle);
@@ -195,7 +206,16 @@ OSErr SavePreferences(const PrefsData *prefs) {
         }
     }
     
-    // Update the data
+    // Update the data, growing a resource saved by an older version
+    if (GetHandleSize(prefHandle) < sizeof(PrefsData)) {
+        SetHandleSize(prefHandle, sizeof(PrefsData));
+        err = MemError();
+        if (err != noErr) {
+            ReleaseResource(prefHandle);
+            CloseResFile(refNum);
+            return err;
+        }
+    }
     HLock(prefHandle);
     BlockMove(prefs, *prefHandle, sizeof(PrefsData));
     HUnlock(prefHandle);
@@ -209,4 +229,91 @@ OSErr SavePreferences(const PrefsData *prefs) {
     CloseResFile(refNum);
     
     return err;
-}
\ No newline at end of file
+}
+
+// Save a QDBM frame as the last image shown, replacing the one before
+OSErr SaveLastFrame(Ptr frame, long size) {
+    OSErr err;
+    short vRefNum;
+    long dirID;
+    short refNum;
+    long count = size;
+    
+    err = GetPreferencesFolder(&vRefNum, &dirID);
+    if (err != noErr) {
+        return err;
+    }
+    
+    err = HCreate(vRefNum, dirID, kFrameFileName, kPrefsFileCreator, kFrameFileType);
+    if (err != noErr && err != dupFNErr) {
+        return err;
+    }
+    
+    err = HOpen(vRefNum, dirID, kFrameFileName, fsRdWrPerm, &refNum);
+    if (err != noErr) {
+        return err;
+    }
+    
+    // One write for the whole frame, header and all
+    err = SetEOF(refNum, size);
+    if (err == noErr) {
+        err = FSWrite(refNum, &count, frame);
+    }
+    FSClose(refNum);
+    
+    if (err != noErr) {
+        // Don't leave half a frame to be drawn next launch
+        HDelete(vRefNum, dirID, kFrameFileName);
+    }
+    
+    return err;
+}
+
+// Load the last image shown into frame, which has room for capacity bytes
+OSErr LoadLastFrame(Ptr frame, long capacity, long *size) {
+    OSErr err;
+    short vRefNum;
+    long dirID;
+    short refNum;
+    long count;
+    QDFrameHeader *header;
+    
+    *size = 0;
+    
+    err = GetPreferencesFolder(&vRefNum, &dirID);
+    if (err != noErr) {
+        return err;
+    }
+    
+    err = HOpen(vRefNum, dirID, kFrameFileName, fsRdPerm, &refNum);
+    if (err != noErr) {
+        return err;
+    }
+    
+    err = GetEOF(refNum, &count);
+    if (err == noErr && count < sizeof(QDFrameHeader)) {
+        err = eofErr;
+    } else if (err == noErr && count > capacity) {
+        err = memFullErr;
+    }
+    if (err != noErr) {
+        FSClose(refNum);
+        return err;
+    }
+    
+    // One read for the whole frame
+    err = FSRead(refNum, &count, frame);
+    FSClose(refNum);
+    
+    header = (QDFrameHeader *)frame;
+    if (err == noErr && (header->magic != kQDFrameMagic ||
+                         sizeof(QDFrameHeader) + header->dataLength > count)) {
+        err = paramErr;
+    }
+    if (err != noErr) {
+        return err;
+    }
+    
+    *size = count;
+    return noErr;
+}
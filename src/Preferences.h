@@ -21,6 +21,11 @@
 #define kPrefsFileType      'pref'
 #define kPrefsFileCreator   'MTRM'
 
+// The last image shown, as a QDBM frame, kept beside the prefs so it
+// can be drawn as soon as we launch
+#define kFrameFileName      "\pMacTRMNL Last Frame"
+#define kFrameFileType      'QDBM'
+
 // Preferences structure (must match AppSettings in MacTRMNL.c)
 typedef struct {
     char ipAddress[20];
@@ -29,6 +34,9 @@ typedef struct {
     Boolean autoRefresh; 
     Boolean enableLogFile;
     Boolean saveSettings;
+    short logLevel;        // kLogLevelError..kLogLevelTrace; 0 in older prefs
+    short logMaxKB;        // Log size before rotating; 0 in older prefs, -1 for no limit
+    Boolean kioskMode;     // Skip settings and go straight to the display
 } PrefsData;
 
 // Function prototypes
@@ -36,5 +44,7 @@ OSErr LoadPreferences(PrefsData *prefs);
 OSErr SavePreferences(const PrefsData *prefs);
 OSErr GetPreferencesFolder(short *vRefNum, long *dirID);
 OSErr CreatePreferencesFile(short vRefNum, long dirID);
+OSErr SaveLastFrame(Ptr frame, long size);
+OSErr LoadLastFrame(Ptr frame, long capacity, long *size);
 
 #endif /* __PREFERENCES_H__ */
\ No newline at end of file
@@ -0,0 +1,262 @@
+/*
+ * Scale.c
+ *
+ * Fits frames to the screen for MacTRMNL
+ * A frame up to half the screen is doubled through a byte-to-word
+ * table. One too big is shrunk by the smallest whole number that fits,
+ * averaging each block of pixels and ordered dithering the result, so
+ * grey areas stay grey rather than dropping out.
+ *
+ * Written by Erik Reynolds
+ * v20250702-1
+ */
+
+#include <QuickDraw.h>
+#include <stdio.h>
+#include "Scale.h"
+#include "Blit.h"
+#include "FrameFormat.h"
+#include "Logging.h"
+
+static short gScreenWidth;
+static short gScreenHeight;
+
+// Each source byte with every pixel doubled
+static unsigned short gDoubleBits[256];
+// The black pixels in each pair of a source byte, a nibble per pair
+static unsigned short gPairInk[256];
+
+// 4x4 Bayer matrix; a block goes black when its share of black
+// pixels, in sixteenths, is over the entry for its position
+static const unsigned char kBayer[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 }
+};
+
+static void CopyImage(const unsigned char *topRow, long rowStride, unsigned char mask,
+                      short width, short height, Ptr bits, short outRowBytes);
+static void DoubleImage(const unsigned char *topRow, long rowStride, unsigned char mask,
+                        short width, short height, Ptr bits, short outRowBytes);
+static void HalveImage(const unsigned char *topRow, long rowStride, unsigned char mask,
+                       short width, short outWidth, short outHeight, Ptr bits, short outRowBytes);
+static void ShrinkImage(const unsigned char *topRow, long rowStride, unsigned char mask, short shrink,
+                        short outWidth, short outHeight, Ptr bits, short outRowBytes);
+
+void InitScale(short screenWidth, short screenHeight) {
+    short value;
+    short bit;
+
+    gScreenWidth = screenWidth;
+    gScreenHeight = screenHeight;
+
+    for (value = 0; value < 256; value++) {
+        gDoubleBits[value] = 0;
+        gPairInk[value] = 0;
+        for (bit = 0; bit < 8; bit++) {
+            if (value & (0x80 >> bit)) {
+                gDoubleBits[value] |= 0xC000 >> (bit * 2);
+                gPairInk[value] += 0x1000 >> ((bit / 2) * 4);
+            }
+        }
+    }
+}
+
+/* Turn an image, given as its top row and the distance from one row to
+ * the next, into a QDBM frame that fits the screen. invert flips every
+ * pixel, for BMPs, where 1 is white. */
+OSErr ScaleImage(const unsigned char *topRow, long rowStride, Boolean invert,
+                 short width, short height, Ptr frame, long frameSize) {
+    QDFrameHeader *header = (QDFrameHeader *)frame;
+    unsigned char mask = invert ? 0xFF : 0x00;
+    short shrink;
+    short outWidth;
+    short outHeight;
+    short outRowBytes;
+#if LOG_COMPILED_LEVEL >= kLogLevelDebug
+    char message[64];
+#endif
+
+    if (width * 2 <= gScreenWidth && height * 2 <= gScreenHeight) {
+        outWidth = width * 2;
+        outHeight = height * 2;
+        shrink = 0;
+    } else if (width <= gScreenWidth && height <= gScreenHeight) {
+        outWidth = width;
+        outHeight = height;
+        shrink = 1;
+    } else {
+        // The smallest whole number that fits both ways
+        shrink = (width + gScreenWidth - 1) / gScreenWidth;
+        if ((height + gScreenHeight - 1) / gScreenHeight > shrink) {
+            shrink = (height + gScreenHeight - 1) / gScreenHeight;
+        }
+        outWidth = width / shrink;
+        outHeight = height / shrink;
+    }
+
+    outRowBytes = ((outWidth + 15) / 16) * 2;
+    if (sizeof(QDFrameHeader) + (long)outRowBytes * outHeight > frameSize) {
+        LogError("Image too large for the screen");
+        return paramErr;
+    }
+
+    header->magic = kQDFrameMagic;
+    header->version = kQDFrameVersion;
+    header->rowBytes = outRowBytes;
+    SetRect(&header->bounds, 0, 0, outWidth, outHeight);
+    header->dataLength = (long)outRowBytes * outHeight;
+
+#if LOG_COMPILED_LEVEL >= kLogLevelDebug
+    if (shrink != 1 && gLogLevel >= kLogLevelDebug) {
+        sprintf(message, "Scaling %dx%d to %dx%d", width, height, outWidth, outHeight);
+        LogDebug(message);
+    }
+#endif
+
+    switch (shrink) {
+        case 0:
+            DoubleImage(topRow, rowStride, mask, width, height, frame + sizeof(QDFrameHeader), outRowBytes);
+            break;
+        case 1:
+            CopyImage(topRow, rowStride, mask, width, height, frame + sizeof(QDFrameHeader), outRowBytes);
+            break;
+        case 2:
+            HalveImage(topRow, rowStride, mask, width, outWidth, outHeight, frame + sizeof(QDFrameHeader), outRowBytes);
+            break;
+        default:
+            ShrinkImage(topRow, rowStride, mask, shrink, outWidth, outHeight, frame + sizeof(QDFrameHeader), outRowBytes);
+            break;
+    }
+    return noErr;
+}
+
+// 1:1, with the CPU's own row kernels
+static void CopyImage(const unsigned char *topRow, long rowStride, unsigned char mask,
+                      short width, short height, Ptr bits, short outRowBytes) {
+    short rowBytes = (width + 7) / 8;
+    unsigned char *destRow = (unsigned char *)bits;
+    short row;
+
+    // A QDBM frame laid out just like ours goes across in one copy
+    if (mask == 0 && rowStride == outRowBytes) {
+        gBlit.copyBytes(topRow, bits, (long)outRowBytes * height);
+        return;
+    }
+
+    for (row = 0; row < height; row++) {
+        if (mask) {
+            gBlit.invertRow(topRow, destRow, rowBytes);
+        } else {
+            gBlit.copyBytes(topRow, destRow, rowBytes);
+        }
+        // Source rows may be shorter than ours by the byte that pads to a word
+        if (rowBytes < outRowBytes) {
+            destRow[rowBytes] = 0xFF;
+        }
+        topRow += rowStride;
+        destRow += outRowBytes;
+    }
+}
+
+// 2x: each byte becomes a word from the table, and each row is drawn twice.
+// Our rows start on a word, so the 68000 can store the words directly.
+static void DoubleImage(const unsigned char *topRow, long rowStride, unsigned char mask,
+                        short width, short height, Ptr bits, short outRowBytes) {
+    short rowBytes = (width + 7) / 8;
+    unsigned short *destRow = (unsigned short *)bits;
+    short row;
+    short col;
+
+    for (row = 0; row < height; row++) {
+        for (col = 0; col < rowBytes; col++) {
+            destRow[col] = gDoubleBits[topRow[col] ^ mask];
+        }
+        gBlit.copyBytes(destRow, (Ptr)destRow + outRowBytes, outRowBytes);
+        topRow += rowStride;
+        destRow += outRowBytes;  // Two rows of words
+    }
+}
+
+// 2:1, the common case of a frame made for a bigger screen. Two source
+// bytes a row give a nibble of ink per pair; adding the rows gives the
+// ink in each 2x2 block, 0 to 4, or 0 to 16 in sixteenths.
+static void HalveImage(const unsigned char *topRow, long rowStride, unsigned char mask,
+                       short width, short outWidth, short outHeight, Ptr bits, short outRowBytes) {
+    short srcBytes = (width + 7) / 8;
+    unsigned char *destRow = (unsigned char *)bits;
+    const unsigned char *nextRow;
+    const unsigned char *bayer;
+    unsigned long ink;
+    unsigned char out;
+    short row;
+    short col;
+    short src;
+    short pixel;
+
+    for (row = 0; row < outHeight; row++) {
+        nextRow = topRow + rowStride;
+        bayer = kBayer[row & 3];
+        for (col = 0; col < outRowBytes; col++) {
+            // Eight output pixels from sixteen across
+            src = col * 2;
+            ink = 0;
+            if (src < srcBytes) {
+                ink = (unsigned long)(gPairInk[topRow[src] ^ mask] + gPairInk[nextRow[src] ^ mask]) << 16;
+            }
+            if (src + 1 < srcBytes) {
+                ink |= gPairInk[topRow[src + 1] ^ mask] + gPairInk[nextRow[src + 1] ^ mask];
+            }
+            out = 0;
+            for (pixel = 0; pixel < 8; pixel++) {
+                if (col * 8 + pixel < outWidth &&
+                    ((ink >> (28 - pixel * 4)) & 15) * 4 > bayer[pixel & 3]) {
+                    out |= 0x80 >> pixel;
+                }
+            }
+            destRow[col] = out;
+        }
+        topRow += rowStride * 2;
+        destRow += outRowBytes;
+    }
+}
+
+// Any other ratio counts the ink in each block a pixel at a time; slow,
+// but only frames over twice the screen's size come this way
+static void ShrinkImage(const unsigned char *topRow, long rowStride, unsigned char mask, short shrink,
+                        short outWidth, short outHeight, Ptr bits, short outRowBytes) {
+    unsigned char *destRow = (unsigned char *)bits;
+    const unsigned char *srcRow;
+    short area = shrink * shrink;
+    short ink;
+    short row;
+    short col;
+    short y;
+    short x;
+    short srcCol;
+
+    for (row = 0; row < outHeight; row++) {
+        for (col = 0; col < outRowBytes; col++) {
+            destRow[col] = 0;
+        }
+        for (col = 0; col < outWidth; col++) {
+            ink = 0;
+            srcRow = topRow;
+            for (y = 0; y < shrink; y++) {
+                for (x = 0; x < shrink; x++) {
+                    srcCol = col * shrink + x;
+                    if ((srcRow[srcCol >> 3] ^ mask) & (0x80 >> (srcCol & 7))) {
+                        ink++;
+                    }
+                }
+                srcRow += rowStride;
+            }
+            if (ink * 16 > kBayer[row & 3][col & 3] * area) {
+                destRow[col >> 3] |= 0x80 >> (col & 7);
+            }
+        }
+        topRow += rowStride * shrink;
+        destRow += outRowBytes;
+    }
+}
@@ -0,0 +1,22 @@
+/*
+ * Scale.h
+ *
+ * Fits frames to the screen for MacTRMNL
+ * Frames that don't match the screen are scaled by a whole number as
+ * they're decoded, so every redraw is still a 1:1 CopyBits
+ *
+ * Written by Erik Reynolds
+ * v20250702-1
+ */
+
+#ifndef __SCALE_H__
+#define __SCALE_H__
+
+#include <Types.h>
+
+/* Function Prototypes */
+void InitScale(short screenWidth, short screenHeight);
+OSErr ScaleImage(const unsigned char *topRow, long rowStride, Boolean invert,
+                 short width, short height, Ptr frame, long frameSize);
+
+#endif /* __SCALE_H__ */
@@ -0,0 +1,122 @@
+/*
+ * Timing.c
+ *
+ * Refresh timing for MacTRMNL
+ * Uses Microseconds where the extended Time Manager has it, otherwise
+ * TickCount, so a 60th-of-a-second blit on a fast Mac isn't just zero
+ *
+ * Written by Erik Reynolds
+ * v20250702-1
+ */
+
+#include <OSUtils.h>
+#include <Timer.h>
+#include <Gestalt.h>
+#include <stdio.h>
+#include "Timing.h"
+#include "Logging.h"
+
+static Boolean gHaveMicroseconds = false;
+
+// Ring of the last kTimingSamples refreshes
+static TimingSample gSamples[kTimingSamples];
+static short gSampleNext = 0;
+static short gSampleCount = 0;
+
+void InitTiming(void) {
+    long version;
+
+    gHaveMicroseconds = Gestalt(gestaltTimeMgrVersion, &version) == noErr &&
+                        version >= gestaltExtendedTimeMgr;
+}
+
+TimingMark TimingStart(void) {
+    TimingMark mark;
+    UnsignedWide now;
+
+    mark.micro = 0;
+    if (gHaveMicroseconds) {
+        Microseconds(&now);
+        mark.micro = now.lo;
+    }
+    mark.ticks = TickCount();
+    return mark;
+}
+
+// Milliseconds from start to end. The low word of Microseconds wraps
+// every 71 minutes, so spans near that (the first image after a long
+// wait for the network, say) are counted in ticks, which are scaled
+// down before they are multiplied so they can't overflow either.
+long TimingBetween(TimingMark start, TimingMark end) {
+    unsigned long ticks = end.ticks - start.ticks;
+
+    if (gHaveMicroseconds && ticks < kTimingMicroTicks) {
+        return (end.micro - start.micro) / 1000;
+    }
+    if (ticks / 60 >= kTimingMaxMillis / 1000) {
+        return kTimingMaxMillis;
+    }
+    return ticks / 60 * 1000 + ticks % 60 * 1000 / 60;
+}
+
+// Milliseconds since start
+long TimingElapsed(TimingMark start) {
+    return TimingBetween(start, TimingStart());
+}
+
+// Stamp and keep a finished refresh, and log it
+void RecordTimingSample(TimingSample *sample) {
+    char summary[160];
+
+    GetDateTime(&sample->when);
+    gSamples[gSampleNext] = *sample;
+    gSampleNext = (gSampleNext + 1) % kTimingSamples;
+    if (gSampleCount < kTimingSamples) {
+        gSampleCount++;
+    }
+
+    sprintf(summary, "Refresh: connect %ld, first byte %ld, receive %ld, decode %ld, blit %ld ms; %ld bytes, %ld free",
+            sample->connect, sample->firstByte, sample->receive, sample->decode, sample->blit,
+            sample->bytes, sample->freeHeap);
+    LogSummary(summary);
+}
+
+short TimingSampleCount(void) {
+    return gSampleCount;
+}
+
+// Most recent refresh, or NULL before the first
+const TimingSample *LastTimingSample(void) {
+    if (gSampleCount == 0) {
+        return NULL;
+    }
+    return &gSamples[(gSampleNext + kTimingSamples - 1) % kTimingSamples];
+}
+
+// Mean of the refreshes kept; when is that of the latest
+void AverageTimingSample(TimingSample *average) {
+    TimingSample total = { 0 };
+    short i;
+
+    for (i = 0; i < gSampleCount; i++) {
+        total.connect += gSamples[i].connect;
+        total.firstByte += gSamples[i].firstByte;
+        total.receive += gSamples[i].receive;
+        total.decode += gSamples[i].decode;
+        total.blit += gSamples[i].blit;
+        total.bytes += gSamples[i].bytes;
+        total.freeHeap += gSamples[i].freeHeap;
+    }
+
+    if (gSampleCount > 0) {
+        total.when = LastTimingSample()->when;
+        total.connect /= gSampleCount;
+        total.firstByte /= gSampleCount;
+        total.receive /= gSampleCount;
+        total.decode /= gSampleCount;
+        total.blit /= gSampleCount;
+        total.bytes /= gSampleCount;
+        total.freeHeap /= gSampleCount;
+    }
+    *average = total;
+}
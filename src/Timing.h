@@ -0,0 +1,54 @@
+/*
+ * Timing.h
+ *
+ * Refresh timing for MacTRMNL
+ * Times each phase of fetching and showing an image, and keeps the
+ * last few refreshes for the log, the stats overlay and the proxy
+ *
+ * Written by Erik Reynolds
+ * v20250702-1
+ */
+
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include <Types.h>
+
+// Refreshes kept for averages
+#define kTimingSamples      16
+
+// Spans shorter than this many ticks (an hour) are timed in Microseconds
+#define kTimingMicroTicks   (60L * 60 * 60)
+// Longest span reported, in milliseconds; longer ones are clamped to it
+#define kTimingMaxMillis    0x7FFFFFFFL
+
+// A point in time from TimingStart. micro is the low word of Microseconds
+// where this Mac has it, for short spans; ticks covers the long ones.
+typedef struct {
+    unsigned long micro;
+    unsigned long ticks;
+} TimingMark;
+
+// One refresh. Durations are in milliseconds.
+typedef struct {
+    unsigned long when;     // GetDateTime seconds
+    long connect;
+    long firstByte;         // From connected to the first data
+    long receive;           // From connected to the whole image
+    long decode;
+    long blit;
+    long bytes;             // Size of the image
+    long freeHeap;          // FreeMem once it was on screen
+} TimingSample;
+
+/* Function Prototypes */
+void InitTiming(void);
+TimingMark TimingStart(void);
+long TimingBetween(TimingMark start, TimingMark end);
+long TimingElapsed(TimingMark start);
+void RecordTimingSample(TimingSample *sample);
+short TimingSampleCount(void);
+const TimingSample *LastTimingSample(void);
+void AverageTimingSample(TimingSample *average);
+
+#endif /* __TIMING_H__ */